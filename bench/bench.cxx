@@ -0,0 +1,945 @@
+/* \file
+ *
+ * \copyright Copyright © 2015  Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "bench/corpus.hxx"
+#include "src/blurpat.hxx"
+#include "src/exceptions.hxx"
+#include "src/jpeg_region_writer.hxx"
+#include "src/log.hxx"
+#include "src/match_engine.hxx"
+#include "src/matcher.hxx"
+#include "src/options.hxx"
+#include "src/redact.hxx"
+#include "src/ssim.hxx"
+#include "src/thread_pool.hxx"
+
+/////////////////////////////////////////////////////////////////////
+
+const char* g_kUsageTemplate{
+"\nUsage: %1$s OPTIONS\n\n"
+"Runs microbenchmarks of the matching stages and an end-to-end benchmark\n"
+"over a generated corpus of synthetic photos with known logo placements.\n\n"
+"OPTIONS:\n"
+" -h, --help               Display this help.\n"
+" -j, --jobs               Number of threads used for matching. Default: 1\n"
+" -n, --images             Number of corpus images. Default: 50\n"
+" -m, --masks              Number of masks searched for. Default: 4\n"
+"     --seed               Random seed. Default: 1\n"
+"     --min-time           Minimum time of a microbenchmark in seconds. Default: 0.2\n"
+"     --min-accuracy       Fail if the end-to-end match accuracy is below the\n"
+"                          value (0..1). Default: 0\n"
+"     --no-check           Skip the checks of the optimized kernels against\n"
+"                          the OpenCV functions they replace\n"
+"     --no-micro           Skip the microbenchmarks\n"
+"     --no-e2e             Skip the end-to-end benchmark\n"
+"     --write-corpus       Write the masks, the images and the ground truth to\n"
+"                          the directory\n"};
+
+const int g_kOptSeed{256};
+const int g_kOptMinTime{257};
+const int g_kOptMinAccuracy{258};
+const int g_kOptNoMicro{259};
+const int g_kOptNoE2E{260};
+const int g_kOptWriteCorpus{261};
+const int g_kOptNoCheck{262};
+
+const char *g_kShortOptions = "hj:n:m:";
+const struct option g_kLongOptions[] = {
+  {"help",         no_argument,       NULL, 'h'},
+  {"jobs",         required_argument, NULL, 'j'},
+  {"images",       required_argument, NULL, 'n'},
+  {"masks",        required_argument, NULL, 'm'},
+  {"seed",         required_argument, NULL, g_kOptSeed},
+  {"min-time",     required_argument, NULL, g_kOptMinTime},
+  {"min-accuracy", required_argument, NULL, g_kOptMinAccuracy},
+  {"no-check",     no_argument,       NULL, g_kOptNoCheck},
+  {"no-micro",     no_argument,       NULL, g_kOptNoMicro},
+  {"no-e2e",       no_argument,       NULL, g_kOptNoE2E},
+  {"write-corpus", required_argument, NULL, g_kOptWriteCorpus},
+  {0,              0,                 0,    0}
+};
+
+/// Thresholds tried by the end-to-end benchmark
+const double g_kThresholds[] = {45, 80, 120, 160};
+/// Minimum intersection over union of a match and the ground truth for the
+/// match to be considered correct
+const double g_kMinIoU{0.5};
+/// Blur parameters (the CLI defaults)
+const int g_kKernelSize{3};
+const int g_kDeviation{10};
+/// Maximum number of corpus images used by the checks
+const int g_kCheckImages{10};
+/// Maximum allowed difference between GetGrayMSSIM() and GetMSSIM()
+const double g_kMSSIMTolerance{1e-3};
+/// Maximum mean absolute difference of a pixel row rewritten by
+/// RewriteJpegRegion() from the full decode/encode result (JPEG quantization)
+const double g_kJpegRowTolerance{4.};
+
+int g_num_threads{1};
+int g_num_images{50};
+int g_num_masks{4};
+unsigned g_seed{1};
+double g_min_time{0.2};
+double g_min_accuracy{0.};
+bool g_check{true};
+bool g_micro{true};
+bool g_e2e{true};
+std::string g_corpus_dir;
+
+std::unique_ptr<ThreadPool> g_thread_pool;
+
+/////////////////////////////////////////////////////////////////////
+
+static double
+GetSeconds(std::chrono::steady_clock::duration duration)
+{
+  return std::chrono::duration<double>(duration).count();
+}
+
+
+/// Calls `fn` repeatedly for at least `g_min_time` seconds after a warm-up call
+/// \returns Seconds per call
+static double
+Measure(const std::function<void()>& fn)
+{
+  fn();
+
+  size_t calls{0};
+  double elapsed;
+  const auto start = std::chrono::steady_clock::now();
+  do {
+    fn();
+    ++calls;
+    elapsed = GetSeconds(std::chrono::steady_clock::now() - start);
+  } while (elapsed < g_min_time);
+
+  return elapsed / calls;
+}
+
+
+/// Outputs a result line. `pixels` is the number of image pixels processed
+/// per call.
+static void
+Report(const char* name, const std::string& params, double seconds, double pixels)
+{
+  printf("%-20s %-28s %12.1f us %10.1f MP/s\n",
+      name, params.c_str(), seconds * 1e6, pixels / seconds / 1e6);
+  fflush(stdout);
+}
+
+
+static std::string
+FormatSize(const cv::Size& size)
+{
+  return std::to_string(size.width) + "x" + std::to_string(size.height);
+}
+
+
+/// Returns thresholded grayscale version of a corpus image
+static cv::Mat
+GetBinaryImage(const cv::Mat& img, double threshold)
+{
+  cv::Mat gray;
+  cv::cvtColor(img, gray, CV_BGR2GRAY);
+  cv::threshold(gray, gray, threshold, 255, CV_THRESH_BINARY);
+  return gray;
+}
+
+
+/// Returns `mask` scaled to `height` keeping the aspect ratio
+static cv::Mat
+ScaleMask(const cv::Mat& mask, int height)
+{
+  cv::Mat scaled;
+  const int width = std::max(1, mask.cols * height / mask.rows);
+  cv::resize(mask, scaled, cv::Size(width, height), 0, 0, cv::INTER_AREA);
+  return scaled;
+}
+
+
+static Mask
+MakeMask(const cv::Mat& gray, const std::string& name)
+{
+  Mask mask;
+  mask.file = name;
+  mask.gray = gray;
+  cv::bitwise_not(mask.gray, mask.inverted);
+  mask.stats = TemplateStats(mask.gray);
+  return mask;
+}
+
+
+/// Returns exact SQDIFF of `tpl` and the window of `img` at `loc`
+static double
+GetSqDiff(const cv::Mat& img, const cv::Mat& tpl, const cv::Point& loc)
+{
+  double sqdiff = 0.;
+  for (int y = 0; y < tpl.rows; ++y) {
+    const uchar* a = img.ptr<uchar>(loc.y + y) + loc.x;
+    const uchar* b = tpl.ptr<uchar>(y);
+    for (int x = 0; x < tpl.cols; ++x) {
+      const double d = static_cast<double>(a[x]) - b[x];
+      sqdiff += d * d;
+    }
+  }
+  return sqdiff;
+}
+
+
+/// Compares the best locations found by MatchEngine with cv::matchTemplate()
+/// called for each template polarity, as the search did before MatchEngine.
+/// A different location is accepted only if its SQDIFF is equal to the one of
+/// the reference location (exact ties are common on binary images), and the
+/// MatchEngine scores must be exact.
+/// \returns Number of mismatches
+static int
+CheckMatchEngine(const std::vector<cv::Mat>& masks, cv::RNG& rng)
+{
+  CorpusOptions corpus_opts;
+  corpus_opts.num_images = std::min(g_num_images, g_kCheckImages);
+  corpus_opts.image_size = cv::Size(640, 360);
+  auto corpus = GenerateCorpus(masks, corpus_opts, rng);
+
+  int num_maps{0};
+  int num_ties{0};
+  int num_mismatches{0};
+  for (auto& item : corpus) {
+    cv::Mat gray;
+    cv::cvtColor(item.img, gray, CV_BGR2GRAY);
+    cv::Mat gray_inverted;
+    cv::bitwise_not(gray, gray_inverted);
+
+    for (auto threshold : g_kThresholds) {
+      for (auto* src : {&gray, &gray_inverted}) {
+        cv::Mat img;
+        cv::threshold(*src, img, threshold, 255, CV_THRESH_BINARY);
+        const MatchEngine engine(img);
+
+        for (auto& mask : masks) {
+          cv::Mat templates[2];
+          templates[0] = mask;
+          cv::bitwise_not(mask, templates[1]);
+          cv::Mat results[2];
+          engine.Match(mask, TemplateStats(mask), results[0], results[1]);
+
+          for (int polarity = 0; polarity < 2; ++polarity) {
+            auto& tpl = templates[polarity];
+            double min_val;
+            cv::Point loc;
+            cv::minMaxLoc(results[polarity], &min_val, NULL, &loc, NULL, cv::Mat());
+            cv::Point expected_loc;
+            MatchTemplateExhaustive(expected_loc, img, tpl);
+            ++num_maps;
+
+            const double sqdiff = GetSqDiff(img, tpl, loc);
+            if (min_val != sqdiff) {
+              ERROR_LOG("MatchEngine score %f at (%d, %d) differs from SQDIFF %f",
+                  min_val, loc.x, loc.y, sqdiff);
+              ++num_mismatches;
+            } else if (loc == expected_loc) {
+              continue;
+            } else if (sqdiff == GetSqDiff(img, tpl, expected_loc)) {
+              ++num_ties;
+            } else {
+              ERROR_LOG("MatchEngine location (%d, %d) differs from matchTemplate (%d, %d)",
+                  loc.x, loc.y, expected_loc.x, expected_loc.y);
+              ++num_mismatches;
+            }
+          }
+        }
+      }
+    }
+  }
+
+  printf("check: MatchEngine     %d maps, %d equal-score ties, %d mismatches\n",
+      num_maps, num_ties, num_mismatches);
+  return num_mismatches;
+}
+
+
+/// Compares GetGrayMSSIM() with the first channel of GetMSSIM() on random,
+/// binary and constant images, including ones smaller than the 11x11 window
+/// where every border pixel is reflected
+/// \returns Number of mismatches
+static int
+CheckGrayMSSIM(cv::RNG& rng)
+{
+  const cv::Size sizes[] = {
+    cv::Size(1, 1), cv::Size(3, 2), cv::Size(5, 7), cv::Size(10, 10), cv::Size(1, 16),
+    cv::Size(11, 11), cv::Size(12, 5), cv::Size(40, 17), cv::Size(96, 48), cv::Size(203, 61)
+  };
+  const char* const kinds[] = {"random", "similar", "binary", "constant", "flat"};
+  const int num_kinds = sizeof(kinds) / sizeof(kinds[0]);
+
+  int num_pairs{0};
+  int num_mismatches{0};
+  double max_diff{0.};
+  for (auto& size : sizes) {
+    for (int kind = 0; kind < num_kinds; ++kind) {
+      cv::Mat i1(size, CV_8UC1), i2(size, CV_8UC1);
+      switch (kind) {
+        case 0: // unrelated noise
+          rng.fill(i1, cv::RNG::UNIFORM, 0, 256);
+          rng.fill(i2, cv::RNG::UNIFORM, 0, 256);
+          break;
+        case 1: // noise and its blurred copy
+          rng.fill(i1, cv::RNG::UNIFORM, 0, 256);
+          cv::GaussianBlur(i1, i2, cv::Size(3, 3), 1);
+          break;
+        case 2: // thresholded images as matched by the search
+          rng.fill(i1, cv::RNG::UNIFORM, 0, 2);
+          rng.fill(i2, cv::RNG::UNIFORM, 0, 2);
+          cv::threshold(i1, i1, 0, 255, CV_THRESH_BINARY);
+          cv::threshold(i2, i2, 0, 255, CV_THRESH_BINARY);
+          break;
+        case 3: // different constants
+          i1.setTo(cv::Scalar(0));
+          i2.setTo(cv::Scalar(255));
+          break;
+        default: // equal constants
+          i1.setTo(cv::Scalar(128));
+          i1.copyTo(i2);
+          break;
+      }
+
+      const double mssim = GetGrayMSSIM(i1, i2);
+      const double expected = GetMSSIM(i1, i2).val[0];
+      const double diff = std::fabs(mssim - expected);
+      max_diff = std::max(max_diff, diff);
+      ++num_pairs;
+      if (diff > g_kMSSIMTolerance) {
+        ERROR_LOG("GetGrayMSSIM() = %f differs from GetMSSIM() = %f for %s %s",
+            mssim, expected, kinds[kind], FormatSize(size).c_str());
+        ++num_mismatches;
+      }
+    }
+  }
+
+  printf("check: GetGrayMSSIM    %d pairs, max difference %g, %d mismatches\n",
+      num_pairs, max_diff, num_mismatches);
+  return num_mismatches;
+}
+
+
+/// Searches the corpus with a scale shrinking the masks to a few pixels. Such
+/// masks are skipped, since their MSSIM is high almost anywhere, so nothing
+/// must be found.
+/// \returns Number of spurious matches
+static int
+CheckTinyScale(const std::vector<cv::Mat>& masks, cv::RNG& rng)
+{
+  std::vector<Mask> search_masks;
+  int max_side{1};
+  for (size_t i = 0; i < masks.size(); ++i) {
+    search_masks.push_back(MakeMask(masks[i], "mask" + std::to_string(i)));
+    max_side = std::max(max_side, std::min(masks[i].cols, masks[i].rows));
+  }
+  const std::vector<double> scales(1, 4. / max_side);
+
+  CorpusOptions corpus_opts;
+  corpus_opts.num_images = std::min(g_num_images, g_kCheckImages);
+  corpus_opts.image_size = cv::Size(320, 180);
+  auto corpus = GenerateCorpus(masks, corpus_opts, rng);
+
+  int num_searches{0};
+  int num_matches{0};
+  for (auto& item : corpus) {
+    cv::Mat gray;
+    cv::cvtColor(item.img, gray, CV_BGR2GRAY);
+
+    for (auto& level : BuildScaleLevels(gray, search_masks, scales, NULL)) {
+      for (auto threshold : g_kThresholds) {
+        auto& level_masks = level.Masks(search_masks);
+        const auto best = FindPattern(level.gray, threshold, level_masks,
+            *g_thread_pool, MatchOptions(), 0., NULL);
+        const auto all = FindPatterns(level.gray, threshold, level_masks,
+            *g_thread_pool, MatchOptions(), 0.1, NULL);
+        ++num_searches;
+
+        if (best.mssim > 0.1 || !all.empty()) {
+          ERROR_LOG("scale %f found %zu match(es), best MSSIM %f", scales[0],
+              all.size(), best.mssim);
+          ++num_matches;
+        }
+      }
+    }
+  }
+
+  printf("check: TinyScale       scale %g, %d searches, %d with matches\n",
+      scales[0], num_searches, num_matches);
+  return num_matches;
+}
+
+
+/// Returns prefix of the temporary files of the checks
+static std::string
+GetTempPrefix()
+{
+  const char* tmp_dir = getenv("TMPDIR");
+  return std::string(tmp_dir ? tmp_dir : "/tmp") + "/blurpat_bench." + std::to_string(getpid());
+}
+
+
+/// Searches the corpus with a region of interest not starting at the origin
+/// and checks that the candidates recorded by RunStats are in the image
+/// coordinates as the result: the best candidate must be equal to the result
+/// (no blur margins), and all of the candidates must lie within the region
+/// \returns Number of mismatches
+static int
+CheckStatsRoi(const std::vector<cv::Mat>& masks, cv::RNG& rng)
+{
+  // Matcher loads the masks from files
+  const std::string prefix(GetTempPrefix());
+  std::vector<std::string> mask_files;
+  for (size_t i = 0; i < masks.size(); ++i) {
+    mask_files.push_back(prefix + ".mask" + std::to_string(i) + ".png");
+    if (!cv::imwrite(mask_files.back(), masks[i])) {
+      throw ErrorException("failed to save to file " + mask_files.back());
+    }
+  }
+  std::shared_ptr<const MaskSet> mask_set(new MaskSet(mask_files, ""));
+  for (auto& mask_file : mask_files) {
+    unlink(mask_file.c_str());
+  }
+  const Matcher matcher(mask_set, *g_thread_pool);
+
+  CorpusOptions corpus_opts;
+  corpus_opts.num_images = std::min(g_num_images, g_kCheckImages);
+  corpus_opts.image_size = cv::Size(640, 360);
+  auto corpus = GenerateCorpus(masks, corpus_opts, rng);
+
+  int num_found{0};
+  int num_mismatches{0};
+  for (auto& item : corpus) {
+    const int margin = 24;
+    const int x0 = std::max(1, item.roi.x - margin);
+    const int y0 = std::max(1, item.roi.y - margin);
+    const int x1 = std::min(item.img.cols, item.roi.x + item.roi.width + margin);
+    const int y1 = std::min(item.img.rows, item.roi.y + item.roi.height + margin);
+
+    RunStats stats("", "");
+    RunOptions opts;
+    opts.roi = cv::Rect(x0, y0, x1 - x0, y1 - y0);
+    opts.thresholds.assign(std::begin(g_kThresholds), std::end(g_kThresholds));
+    opts.scales = {1., 1.25};
+    opts.stats = &stats;
+
+    MatchResult best;
+    try {
+      best = matcher.Find(item.img, opts)[0];
+    } catch (ErrorException&) {
+      continue;
+    }
+    ++num_found;
+
+    bool has_best = false;
+    for (auto& candidate : stats.Candidates()) {
+      has_best = has_best || (candidate.mssim == best.mssim
+          && candidate.threshold == best.threshold && candidate.roi == best.roi);
+      if ((candidate.roi & opts.roi) != candidate.roi) {
+        ERROR_LOG("candidate %d,%d %dx%d is outside of ROI %d,%d %dx%d",
+            candidate.roi.x, candidate.roi.y, candidate.roi.width, candidate.roi.height,
+            opts.roi.x, opts.roi.y, opts.roi.width, opts.roi.height);
+        ++num_mismatches;
+        break;
+      }
+    }
+    if (!has_best) {
+      ERROR_LOG("no candidate is equal to the result %d,%d %dx%d with ROI %d,%d %dx%d",
+          best.roi.x, best.roi.y, best.roi.width, best.roi.height,
+          opts.roi.x, opts.roi.y, opts.roi.width, opts.roi.height);
+      ++num_mismatches;
+    }
+  }
+
+  printf("check: StatsRoi        %d images found, %d mismatches\n", num_found, num_mismatches);
+  return num_mismatches;
+}
+
+
+/// Returns contents of file `filename`
+static std::string
+ReadFile(const std::string& filename)
+{
+  std::ifstream in(filename, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+
+/// Compares regions redacted by RewriteJpegRegion() with the same regions
+/// redacted on the fully decoded image. The regions reach the bottom and right
+/// edges, where the filters must reflect the image border rather than read the
+/// rows decoded around the strip. The output must also be the same on each run.
+/// \returns Number of mismatches
+static int
+CheckJpegRegionWriter(cv::RNG& rng)
+{
+  const std::string prefix(GetTempPrefix());
+  const std::string input_file(prefix + ".jpg");
+  const std::string output_files[2] = {prefix + ".0.jpg", prefix + ".1.jpg"};
+
+  // Smooth noise similar to photos, so that the requantization error is small
+  cv::Mat img(cv::Size(160, 120), CV_8UC3);
+  rng.fill(img, cv::RNG::UNIFORM, 0, 256);
+  cv::GaussianBlur(img, img, cv::Size(0, 0), 3);
+  if (!cv::imwrite(input_file, img, std::vector<int>{CV_IMWRITE_JPEG_QUALITY, 95})) {
+    throw ErrorException("failed to save to file " + input_file);
+  }
+  const cv::Mat input(cv::imread(input_file));
+
+  const cv::Rect rects[] = {
+    cv::Rect(48, 96, 40, 24), cv::Rect(120, 100, 40, 20), cv::Rect(0, 112, 160, 8)
+  };
+  RedactOptions redact_opts[2];
+  redact_opts[1].mode = RedactMode::kBox;
+  redact_opts[1].kernel_size = 0;
+  redact_opts[1].deviation = 5;
+
+  int num_regions{0};
+  int num_mismatches{0};
+  double max_diff{0.};
+  for (auto& rect : rects) {
+    for (auto& opts : redact_opts) {
+      auto filter = [&opts](cv::Mat& region) { Redact(region, opts); };
+      bool rewritten = true;
+      for (auto& output_file : output_files) {
+        rewritten = rewritten && RewriteJpegRegion(input_file, output_file, rect,
+            GetRedactRadius(opts), filter);
+      }
+      if (!rewritten) {
+        unlink(input_file.c_str());
+        printf("check: JpegRegionWriter skipped (not supported by the build)\n");
+        return 0;
+      }
+      ++num_regions;
+
+      if (ReadFile(output_files[0]) != ReadFile(output_files[1])) {
+        ERROR_LOG("RewriteJpegRegion() output for %d,%d %dx%d differs between runs",
+            rect.x, rect.y, rect.width, rect.height);
+        ++num_mismatches;
+      }
+
+      cv::Mat expected(input.clone());
+      cv::Mat region(expected(rect));
+      filter(region);
+      const cv::Mat output(cv::imread(output_files[0]));
+      for (int y = rect.y; y < rect.y + rect.height; ++y) {
+        const double diff = cv::norm(output(cv::Rect(rect.x, y, rect.width, 1)),
+            expected(cv::Rect(rect.x, y, rect.width, 1)), cv::NORM_L1) / (rect.width * 3);
+        max_diff = std::max(max_diff, diff);
+        if (diff > g_kJpegRowTolerance) {
+          ERROR_LOG("RewriteJpegRegion() row %d of %d,%d %dx%d differs from the full"
+              " decode by %f", y, rect.x, rect.y, rect.width, rect.height, diff);
+          ++num_mismatches;
+        }
+      }
+    }
+  }
+
+  unlink(input_file.c_str());
+  for (auto& output_file : output_files) {
+    unlink(output_file.c_str());
+  }
+
+  printf("check: JpegRegionWriter %d regions, max row difference %g, %d mismatches\n",
+      num_regions, max_diff, num_mismatches);
+  return num_mismatches;
+}
+
+
+/// Runs the checks of the optimized kernels
+/// \returns Number of failures
+static int
+RunChecks(const std::vector<cv::Mat>& masks)
+{
+  // Separate generator, so the checks don't change the benchmark inputs
+  cv::RNG rng(g_seed);
+  int num_failures{0};
+
+  num_failures += CheckMatchEngine(masks, rng);
+  num_failures += CheckGrayMSSIM(rng);
+  num_failures += CheckTinyScale(masks, rng);
+  num_failures += CheckStatsRoi(masks, rng);
+  num_failures += CheckJpegRegionWriter(rng);
+
+  fflush(stdout);
+  return num_failures;
+}
+
+
+static void
+RunMicroBenchmarks(const std::vector<cv::Mat>& masks, cv::RNG& rng)
+{
+  const cv::Size image_sizes[] = {cv::Size(320, 240), cv::Size(640, 480), cv::Size(1280, 720)};
+  const int template_heights[] = {16, 32, 64};
+
+  printf("\n%-20s %-28s %15s %15s\n", "benchmark", "parameters", "time/call", "throughput");
+
+  for (auto& image_size : image_sizes) {
+    CorpusOptions corpus_opts;
+    corpus_opts.num_images = 1;
+    corpus_opts.image_size = image_size;
+    auto corpus = GenerateCorpus(masks, corpus_opts, rng);
+    const cv::Mat img(GetBinaryImage(corpus[0].img, g_kThresholds[1]));
+    const double pixels = img.total();
+
+    for (int height : template_heights) {
+      const cv::Mat tpl(ScaleMask(masks[0], height));
+      const std::string params(FormatSize(image_size) + " tpl " + FormatSize(tpl.size()));
+      cv::Point match_loc;
+
+      Report("MatchTemplate", params, Measure([&] {
+            MatchTemplateExhaustive(match_loc, img, tpl);
+            }), pixels);
+
+      MatchOptions pyramid_opts;
+      pyramid_opts.pyramid_levels = 2;
+      Report("MatchTemplate/pyr2", params, Measure([&] {
+            MatchTemplate(match_loc, img, tpl, pyramid_opts);
+            }), pixels);
+
+      // Both polarities; the integral images are computed once per image
+      const MatchEngine engine(img);
+      const TemplateStats stats(tpl);
+      cv::Mat result, result_inverted;
+      Report("MatchEngine", params, Measure([&] {
+            engine.Match(tpl, stats, result, result_inverted);
+            }), pixels);
+    }
+  }
+
+  for (int height : template_heights) {
+    const cv::Mat tpl(ScaleMask(masks[0], height));
+    cv::Mat other(tpl.clone());
+    cv::GaussianBlur(other, other, cv::Size(3, 3), 1);
+    const std::string params("tpl " + FormatSize(tpl.size()));
+    const double pixels = tpl.total();
+
+    Report("GetMSSIM", params, Measure([&] { GetMSSIM(tpl, other); }), pixels);
+    Report("GetAvgMSSIM", params, Measure([&] { GetAvgMSSIM(tpl, other); }), pixels);
+  }
+
+  const cv::Size blur_sizes[] = {cv::Size(64, 32), cv::Size(256, 128), cv::Size(1024, 512)};
+  for (auto& size : blur_sizes) {
+    cv::Mat src(size, CV_8UC3);
+    rng.fill(src, cv::RNG::UNIFORM, 0, 256);
+    cv::Mat region;
+
+    Report("Blur", FormatSize(size) + " k3", Measure([&] {
+          src.copyTo(region);
+          Blur(region, g_kKernelSize, g_kDeviation);
+          }), size.area());
+    Report("Blur", FormatSize(size) + " k0 d10", Measure([&] {
+          src.copyTo(region);
+          Blur(region, 0, g_kDeviation);
+          }), size.area());
+
+    // Redaction modes with a large radius
+    const RedactMode modes[] = {RedactMode::kBox, RedactMode::kPixelate, RedactMode::kFill};
+    const char* const mode_names[] = {"Redact/box", "Redact/pixelate", "Redact/fill"};
+    for (int i = 0; i < 3; ++i) {
+      RedactOptions redact_opts;
+      redact_opts.mode = modes[i];
+      redact_opts.kernel_size = 0;
+      redact_opts.deviation = 100;
+      Report(mode_names[i], FormatSize(size) + " k0 d100", Measure([&] {
+            src.copyTo(region);
+            Redact(region, redact_opts);
+            }), size.area());
+    }
+  }
+
+  // Whole search for several masks on a bottom strip of a HD image
+  const int mask_counts[] = {1, 4, 16};
+  CorpusOptions corpus_opts;
+  corpus_opts.num_images = 1;
+  corpus_opts.image_size = cv::Size(1280, 360);
+  auto corpus = GenerateCorpus(masks, corpus_opts, rng);
+  cv::Mat gray;
+  cv::cvtColor(corpus[0].img, gray, CV_BGR2GRAY);
+  auto all_masks = GenerateMasks(*std::max_element(std::begin(mask_counts), std::end(mask_counts)), rng);
+
+  for (int count : mask_counts) {
+    std::vector<Mask> search_masks;
+    for (int i = 0; i < count; ++i) {
+      search_masks.push_back(MakeMask(all_masks[i], "mask" + std::to_string(i)));
+    }
+
+    Report("FindPattern", FormatSize(gray.size()) + " masks " + std::to_string(count)
+        + " j" + std::to_string(g_num_threads), Measure([&] {
+          FindPattern(gray, g_kThresholds[1], search_masks, *g_thread_pool, MatchOptions(), 0., NULL);
+          }), gray.total());
+    Report("FindPatterns", FormatSize(gray.size()) + " masks " + std::to_string(count)
+        + " j" + std::to_string(g_num_threads), Measure([&] {
+          FindPatterns(gray, g_kThresholds[1], search_masks, *g_thread_pool, MatchOptions(), 0.1, NULL);
+          }), gray.total());
+  }
+
+  // Frame of a 1080p sequence searched around the previous match as
+  // Matcher::Track() does with the default radius. The time per call is the
+  // per-frame budget of the search (33 ms at 30 fps).
+  {
+    CorpusOptions frame_opts;
+    frame_opts.num_images = 1;
+    frame_opts.image_size = cv::Size(1920, 1080);
+    auto frames = GenerateCorpus(masks, frame_opts, rng);
+    const cv::Mat& frame = frames[0].img;
+    const int radius = RunOptions().track_radius;
+    cv::Rect window(frames[0].roi.x - radius, frames[0].roi.y - radius,
+        frames[0].roi.width + 2 * radius, frames[0].roi.height + 2 * radius);
+    window &= cv::Rect(0, 0, frame.cols, frame.rows);
+
+    std::vector<Mask> track_masks;
+    for (size_t i = 0; i < masks.size(); ++i) {
+      track_masks.push_back(MakeMask(masks[i], "mask" + std::to_string(i)));
+    }
+
+    Report("Track", FormatSize(frame.size()) + " r" + std::to_string(radius)
+        + " masks " + std::to_string(track_masks.size()), Measure([&] {
+          FindPattern(GetGrayRegion(frame, window), g_kThresholds[1], track_masks,
+              *g_thread_pool, MatchOptions(), 0., NULL);
+          }), frame.total());
+  }
+
+  // Search at several scales in 0.5..2.0 sharing the best MSSIM between the
+  // levels
+  std::vector<Mask> scale_masks;
+  for (int i = 0; i < 4; ++i) {
+    scale_masks.push_back(MakeMask(all_masks[i], "mask" + std::to_string(i)));
+  }
+  for (int num_scales : {1, 4, 16}) {
+    std::vector<double> scales;
+    for (int i = 0; i < num_scales; ++i) {
+      scales.push_back(num_scales > 1 ? 0.5 + 1.5 * i / (num_scales - 1) : 1.);
+    }
+
+    Report("FindPattern/scales", FormatSize(gray.size()) + " masks 4 scales "
+        + std::to_string(num_scales), Measure([&] {
+          double best_mssim = 0.;
+          for (auto& level : BuildScaleLevels(gray, scale_masks, scales, NULL)) {
+            auto result = FindPattern(level.gray, g_kThresholds[1], level.Masks(scale_masks),
+                *g_thread_pool, MatchOptions(), best_mssim, NULL);
+            best_mssim = std::max(best_mssim, result.mssim);
+          }
+          }), gray.total());
+  }
+}
+
+
+/// Returns intersection over union of two rectangles
+static double
+GetIoU(const cv::Rect& a, const cv::Rect& b)
+{
+  const double intersection = (a & b).area();
+  const double union_area = a.area() + b.area() - intersection;
+  return union_area > 0 ? intersection / union_area : 0.;
+}
+
+
+/// Runs the matching pipeline over generated corpus
+/// \returns Match accuracy
+static double
+RunEndToEnd(const std::vector<cv::Mat>& masks, cv::RNG& rng)
+{
+  CorpusOptions corpus_opts;
+  corpus_opts.num_images = g_num_images;
+  auto corpus = GenerateCorpus(masks, corpus_opts, rng);
+
+  if (!g_corpus_dir.empty()) {
+    WriteCorpus(g_corpus_dir, masks, corpus);
+    printf("corpus written to %s\n", g_corpus_dir.c_str());
+  }
+
+  std::vector<Mask> search_masks;
+  for (size_t i = 0; i < masks.size(); ++i) {
+    search_masks.push_back(MakeMask(masks[i], "mask" + std::to_string(i)));
+  }
+
+  int num_correct[2]{0, 0};
+  int num_images[2]{0, 0};
+  double sum_iou{0.};
+  double pixels{0.};
+
+  const auto start = std::chrono::steady_clock::now();
+  for (auto& item : corpus) {
+    cv::Mat img(item.img.clone());
+    cv::Mat gray;
+    cv::cvtColor(img, gray, CV_BGR2GRAY);
+
+    MatchResult result;
+    for (auto threshold : g_kThresholds) {
+      auto candidate = FindPattern(gray, threshold, search_masks, *g_thread_pool,
+          MatchOptions(), result.mssim, NULL);
+      if (candidate.mssim > result.mssim) {
+        result = candidate;
+      }
+    }
+
+    if (result.roi.area() > 0) {
+      cv::Mat region(img(result.roi));
+      Blur(region, g_kKernelSize, g_kDeviation);
+    }
+
+    const double iou = GetIoU(result.roi, item.roi);
+    sum_iou += iou;
+    ++num_images[item.inverted];
+    if (iou >= g_kMinIoU) {
+      ++num_correct[item.inverted];
+    }
+    pixels += img.total();
+  }
+  const double elapsed = GetSeconds(std::chrono::steady_clock::now() - start);
+
+  const int total_images = num_images[0] + num_images[1];
+  const int total_correct = num_correct[0] + num_correct[1];
+  const double accuracy = total_images ? static_cast<double>(total_correct) / total_images : 0.;
+
+  printf("\nend-to-end: %d images %s, %zu masks, %zu thresholds, %d thread(s)\n",
+      total_images, FormatSize(corpus_opts.image_size).c_str(), masks.size(),
+      sizeof(g_kThresholds) / sizeof(g_kThresholds[0]), g_num_threads);
+  printf("throughput: %.2f images/s %.2f MP/s\n",
+      total_images / elapsed, pixels / elapsed / 1e6);
+  printf("accuracy:   %.3f (normal %d/%d, inverted %d/%d), mean IoU %.3f\n",
+      accuracy, num_correct[0], num_images[0], num_correct[1], num_images[1],
+      total_images ? sum_iou / total_images : 0.);
+
+  return accuracy;
+}
+
+/////////////////////////////////////////////////////////////////////
+
+int
+main(int argc, char **argv)
+{
+  int next_option;
+
+  try {
+    do {
+      next_option = getopt_long(argc, argv, g_kShortOptions, g_kLongOptions, NULL);
+
+      switch (next_option) {
+        case 'h':
+          printf(g_kUsageTemplate, argv[0]);
+          ::exit(EXIT_SUCCESS);
+
+        case 'j':
+          g_num_threads = GetOptArg<int>(optarg, "Invalid number of jobs");
+          break;
+
+        case 'n':
+          g_num_images = GetOptArg<int>(optarg, "Invalid number of images");
+          break;
+
+        case 'm':
+          g_num_masks = GetOptArg<int>(optarg, "Invalid number of masks");
+          break;
+
+        case g_kOptSeed:
+          g_seed = GetOptArg<unsigned>(optarg, "Invalid seed");
+          break;
+
+        case g_kOptMinTime:
+          g_min_time = GetOptArg<double>(optarg, "Invalid minimum time");
+          break;
+
+        case g_kOptMinAccuracy:
+          g_min_accuracy = GetOptArg<double>(optarg, "Invalid minimum accuracy");
+          break;
+
+        case g_kOptNoCheck:
+          g_check = false;
+          break;
+
+        case g_kOptNoMicro:
+          g_micro = false;
+          break;
+
+        case g_kOptNoE2E:
+          g_e2e = false;
+          break;
+
+        case g_kOptWriteCorpus:
+          g_corpus_dir = optarg;
+          break;
+
+        case -1:
+          // done with options
+          break;
+
+        default:
+          fprintf(stderr, g_kUsageTemplate, argv[0]);
+          ::exit(EXIT_FAILURE);
+      }
+    } while (next_option != -1);
+  } catch (InvalidCliArgException& e) {
+    ERROR_LOG("%s", e.what());
+    ::exit(EXIT_FAILURE);
+  }
+
+  if (g_num_threads < 1 || g_num_images < 1 || g_num_masks < 1) {
+    ERROR_LOG0("number of jobs, images and masks must be positive");
+    ::exit(EXIT_FAILURE);
+  }
+
+  int status{EXIT_SUCCESS};
+  try {
+    g_thread_pool.reset(new ThreadPool(g_num_threads));
+
+    cv::RNG rng(g_seed);
+    auto masks = GenerateMasks(g_num_masks, rng);
+
+    if (g_check && RunChecks(masks) > 0) {
+      ERROR_LOG0("checks failed");
+      status = EXIT_FAILURE;
+    }
+    if (g_micro) {
+      RunMicroBenchmarks(masks, rng);
+    }
+    if (g_e2e && RunEndToEnd(masks, rng) < g_min_accuracy) {
+      ERROR_LOG("accuracy is below %f", g_min_accuracy);
+      status = EXIT_FAILURE;
+    }
+  } catch (ErrorException& e) {
+    ERROR_LOG("Fatal error: %s", e.what());
+    status = EXIT_FAILURE;
+  } catch (std::exception& e) {
+    ERROR_LOG("Uncaugth exception: %s", e.what());
+    status = EXIT_FAILURE;
+  }
+
+  return status;
+}
+
+// vim: et ts=2 sts=2 sw=2
@@ -0,0 +1,198 @@
+/* \file
+ *
+ * \copyright Copyright © 2015  Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "corpus.hxx"
+#include "src/exceptions.hxx"
+
+/////////////////////////////////////////////////////////////////////
+
+namespace {
+
+const char* const kLogoTexts[] = {
+  "ACME", "TV24", "NEWS", "LOGO", "CAM7", "BLUR", "ZOOM", "HD1",
+  "SPORT", "KINO", "RADIO", "MAPS", "AUTO", "CITY", "INFO", "LIVE"
+};
+const int kNumLogoTexts = sizeof(kLogoTexts) / sizeof(kLogoTexts[0]);
+
+/// Padding around the glyphs of a mask
+const int kMaskPadding{4};
+/// Background brightness range. Light logos are brighter than any of the
+/// background pixels, so they survive the thresholds used by the benchmark.
+const int kBackgroundMin{10};
+const int kBackgroundMax{110};
+/// Number of random shapes drawn on the background
+const int kNumClutterShapes{12};
+
+
+cv::Scalar
+RandomGray(cv::RNG& rng, int min, int max)
+{
+  const int base = rng.uniform(min, max + 1);
+  // Slightly tinted gray
+  return cv::Scalar(
+      cv::saturate_cast<uchar>(base + rng.uniform(-8, 9)),
+      cv::saturate_cast<uchar>(base + rng.uniform(-8, 9)),
+      cv::saturate_cast<uchar>(base + rng.uniform(-8, 9)));
+}
+
+
+/// Fills `img` with a gradient and random shapes
+void
+DrawBackground(cv::Mat& img, cv::RNG& rng)
+{
+  const cv::Scalar from(RandomGray(rng, kBackgroundMin, kBackgroundMax));
+  const cv::Scalar to(RandomGray(rng, kBackgroundMin, kBackgroundMax));
+
+  for (int y = 0; y < img.rows; ++y) {
+    const double k = static_cast<double>(y) / std::max(1, img.rows - 1);
+    img.row(y).setTo(from * (1. - k) + to * k);
+  }
+
+  for (int i = 0; i < kNumClutterShapes; ++i) {
+    const cv::Point center(rng.uniform(0, img.cols), rng.uniform(0, img.rows));
+    const int size = rng.uniform(10, std::max(11, std::min(img.cols, img.rows) / 4));
+    const cv::Scalar color(RandomGray(rng, kBackgroundMin, kBackgroundMax));
+
+    if (rng.uniform(0, 2)) {
+      cv::circle(img, center, size / 2, color, -1, CV_AA);
+    } else {
+      cv::rectangle(img, center, center + cv::Point(size, size / 2), color, -1);
+    }
+  }
+}
+
+} // namespace
+
+/////////////////////////////////////////////////////////////////////
+
+std::vector<cv::Mat>
+GenerateMasks(int count, cv::RNG& rng)
+{
+  std::vector<cv::Mat> masks;
+
+  for (int i = 0; i < count; ++i) {
+    const std::string text(kLogoTexts[i % kNumLogoTexts]);
+    const int font = cv::FONT_HERSHEY_SIMPLEX;
+    const double scale = rng.uniform(0.6, 1.4);
+    const int thickness = 2;
+
+    int baseline = 0;
+    const cv::Size text_size(cv::getTextSize(text, font, scale, thickness, &baseline));
+    cv::Mat mask(cv::Mat::zeros(text_size.height + baseline + kMaskPadding * 2,
+          text_size.width + kMaskPadding * 2, CV_8UC1));
+
+    cv::putText(mask, text, cv::Point(kMaskPadding, kMaskPadding + text_size.height),
+        font, scale, cv::Scalar(255), thickness, CV_AA);
+    // Frame some of the logos
+    if (i % 3 == 1) {
+      cv::rectangle(mask, cv::Point(0, 0), cv::Point(mask.cols - 1, mask.rows - 1),
+          cv::Scalar(255), 1);
+    }
+
+    masks.push_back(mask);
+  }
+
+  return masks;
+}
+
+
+std::vector<CorpusImage>
+GenerateCorpus(const std::vector<cv::Mat>& masks, const CorpusOptions& opts, cv::RNG& rng)
+{
+  std::vector<CorpusImage> corpus;
+
+  for (int i = 0; i < opts.num_images; ++i) {
+    CorpusImage item;
+    item.mask_index = rng.uniform(0, static_cast<int>(masks.size()));
+    item.inverted = rng.uniform(0., 1.) < opts.inverted_ratio;
+
+    const cv::Mat& mask = masks[item.mask_index];
+    if (mask.cols > opts.image_size.width || mask.rows > opts.image_size.height) {
+      throw ErrorException("image size is too small for the masks");
+    }
+
+    item.img.create(opts.image_size, CV_8UC3);
+    DrawBackground(item.img, rng);
+
+    item.roi = cv::Rect(rng.uniform(0, opts.image_size.width - mask.cols + 1),
+        rng.uniform(0, opts.image_size.height - mask.rows + 1),
+        mask.cols, mask.rows);
+    cv::Mat logo_region(item.img(item.roi));
+
+    if (item.inverted) {
+      // Dark logo on a light plate
+      logo_region.setTo(RandomGray(rng, 200, 240));
+      logo_region.setTo(RandomGray(rng, 0, 40), mask);
+    } else {
+      logo_region.setTo(RandomGray(rng, 210, 255), mask);
+    }
+
+    cv::Mat noise(item.img.size(), CV_16SC3);
+    rng.fill(noise, cv::RNG::NORMAL, 0, opts.noise_deviation);
+    cv::Mat noisy;
+    item.img.convertTo(noisy, CV_16SC3);
+    noisy += noise;
+    noisy.convertTo(item.img, CV_8UC3);
+
+    corpus.push_back(item);
+  }
+
+  return corpus;
+}
+
+
+void
+WriteCorpus(const std::string& dir, const std::vector<cv::Mat>& masks,
+    const std::vector<CorpusImage>& corpus)
+{
+  char filename[64];
+
+  for (size_t i = 0; i < masks.size(); ++i) {
+    snprintf(filename, sizeof(filename), "/mask%02zu.png", i);
+    if (!cv::imwrite(dir + filename, masks[i])) {
+      throw ErrorException("failed to save to file " + dir + filename);
+    }
+  }
+
+  std::ofstream truth(dir + "/truth.txt");
+  if (!truth) {
+    throw ErrorException("failed to open " + dir + "/truth.txt");
+  }
+
+  for (size_t i = 0; i < corpus.size(); ++i) {
+    auto& item = corpus[i];
+
+    snprintf(filename, sizeof(filename), "/image%04zu.png", i);
+    if (!cv::imwrite(dir + filename, item.img)) {
+      throw ErrorException("failed to save to file " + dir + filename);
+    }
+
+    truth << dir << filename << '\t' << item.mask_index << '\t'
+      << item.roi.x << ',' << item.roi.y << ','
+      << item.roi.width << ',' << item.roi.height << '\t'
+      << (item.inverted ? "inverted" : "normal") << '\n';
+  }
+}
+
+// vim: et ts=2 sts=2 sw=2
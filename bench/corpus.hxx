@@ -0,0 +1,64 @@
+/* \file
+ *
+ * \copyright Copyright © 2015  Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#pragma once
+#ifndef CORPUS_HXX
+#define CORPUS_HXX
+
+#include <string>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+/// Synthetic photo with a known logo placement
+struct CorpusImage {
+  /// BGR image
+  cv::Mat img;
+  /// Index of the mask placed on the image
+  size_t mask_index{0};
+  /// Location of the mask
+  cv::Rect roi;
+  /// Whether the logo is dark on a light plate rather than light on the
+  /// background
+  bool inverted{false};
+};
+
+/// Parameters of GenerateCorpus()
+struct CorpusOptions {
+  int num_images{50};
+  cv::Size image_size{1280, 720};
+  /// Standard deviation of the Gaussian noise added to the images
+  double noise_deviation{8.};
+  /// Fraction of the images with inverted logos
+  double inverted_ratio{0.3};
+};
+
+/// Generates `count` logo masks (light glyphs on black background)
+std::vector<cv::Mat> GenerateMasks(int count, cv::RNG& rng);
+
+/// Generates synthetic photos each containing one of `masks` at a random
+/// location on a cluttered noisy background
+std::vector<CorpusImage> GenerateCorpus(const std::vector<cv::Mat>& masks,
+    const CorpusOptions& opts, cv::RNG& rng);
+
+/// Writes masks as `mask<N>.png`, images as `image<N>.png` and the ground
+/// truth as `truth.txt` into directory `dir`
+void WriteCorpus(const std::string& dir, const std::vector<cv::Mat>& masks,
+    const std::vector<CorpusImage>& corpus);
+
+#endif // CORPUS_HXX
+// vim: et ts=2 sts=2 sw=2
@@ -0,0 +1,101 @@
+/* \file
+ *
+ * \copyright Copyright © 2015  Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+
+#include "atomic_file.hxx"
+#include "exceptions.hxx"
+
+/////////////////////////////////////////////////////////////////////
+
+namespace {
+
+/// Sequence number making the temporary names unique within the process
+std::atomic<unsigned> g_temp_counter{0};
+
+/// Maximum number of attempts to create a temporary file
+const int kMaxAttempts{100};
+
+} // namespace
+
+/////////////////////////////////////////////////////////////////////
+
+AtomicFile::AtomicFile(const std::string& filename)
+  : mFilename(filename)
+{
+  // Unlike mkstemp(), open() applies the umask to the usual 0666 mode, so the
+  // target gets the same permissions as a file created directly
+  int fd = -1;
+  for (int attempt = 0; fd < 0 && attempt < kMaxAttempts; ++attempt) {
+    mTempFilename = filename + ".tmp." + std::to_string(getpid())
+      + "." + std::to_string(g_temp_counter++);
+    fd = ::open(mTempFilename.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (fd < 0 && errno != EEXIST) {
+      break;
+    }
+  }
+  if (fd < 0) {
+    throw ErrorException("failed to create temporary file %s: %s",
+        mTempFilename.c_str(), strerror(errno));
+  }
+
+  mFile = fdopen(fd, "wb");
+  if (!mFile) {
+    const int error = errno;
+    ::close(fd);
+    unlink(mTempFilename.c_str());
+    throw ErrorException("failed to open temporary file %s: %s",
+        mTempFilename.c_str(), strerror(error));
+  }
+}
+
+
+AtomicFile::~AtomicFile()
+{
+  if (mFile) {
+    fclose(mFile);
+  }
+  if (!mCommitted) {
+    unlink(mTempFilename.c_str());
+  }
+}
+
+
+void
+AtomicFile::Commit()
+{
+  // Buffered data is written by fclose(), so its result is checked as well
+  const bool write_error = ferror(mFile) != 0;
+  const bool close_error = fclose(mFile) != 0;
+  mFile = nullptr;
+  if (write_error || close_error) {
+    throw ErrorException("failed to write " + mTempFilename);
+  }
+
+  if (rename(mTempFilename.c_str(), mFilename.c_str()) != 0) {
+    throw ErrorException("failed to rename %s to %s: %s",
+        mTempFilename.c_str(), mFilename.c_str(), strerror(errno));
+  }
+  mCommitted = true;
+}
+
+// vim: et ts=2 sts=2 sw=2
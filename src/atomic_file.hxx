@@ -0,0 +1,56 @@
+/* \file
+ *
+ * \copyright Copyright © 2015  Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#pragma once
+#ifndef ATOMIC_FILE_HXX
+#define ATOMIC_FILE_HXX
+
+#include <cstdio>
+#include <string>
+
+/// Output file written under a unique temporary name in the directory of the
+/// target and renamed over the target by Commit().
+///
+/// Readers never see a partially written target, the target may be the file
+/// being read while writing, and the temporary file is removed if Commit() is
+/// not reached.
+class AtomicFile
+{
+  public:
+    /// Creates the temporary file. Throws ErrorException on errors.
+    explicit AtomicFile(const std::string& filename);
+    /// Removes the temporary file unless committed
+    ~AtomicFile();
+
+    AtomicFile(const AtomicFile&) = delete;
+    AtomicFile& operator=(const AtomicFile&) = delete;
+
+    FILE* Get() const { return mFile; }
+
+    /// Closes the file checking for write errors and renames it over the
+    /// target. Throws ErrorException on errors.
+    void Commit();
+
+  private:
+    std::string mFilename;
+    std::string mTempFilename;
+    FILE* mFile{nullptr};
+    bool mCommitted{false};
+};
+
+#endif // ATOMIC_FILE_HXX
+// vim: et ts=2 sts=2 sw=2
@@ -0,0 +1,434 @@
+/* \file
+ *
+ * \copyright Copyright © 2015  Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include <algorithm>
+
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "blurpat.hxx"
+#include "exceptions.hxx"
+#include "image_reader.hxx"
+#include "jpeg_region_writer.hxx"
+#include "log.hxx"
+
+/////////////////////////////////////////////////////////////////////
+
+namespace {
+
+/// Redacts region of an image updating the statistics
+void
+RedactRegion(cv::Mat& region, const RunOptions& opts)
+{
+  StageTimer timer(opts.stats, RunStats::kBlur);
+  timer.Add(region);
+  Redact(region, opts.redact);
+}
+
+
+/// Converts `roi` relative to `in_img_roi` into image coordinates adding the
+/// blur margins
+void
+AddBlurMargins(cv::Rect& roi, const cv::Rect& in_img_roi, const RunOptions& opts)
+{
+  roi.x      += in_img_roi.x - opts.blur_margin[3];
+  roi.y      += in_img_roi.y - opts.blur_margin[0];
+  roi.width  += opts.blur_margin[1] + opts.blur_margin[3];
+  roi.height += opts.blur_margin[2] + opts.blur_margin[0];
+}
+
+
+/// Maps `match` found on `level` to the coordinates of the grayscale region of
+/// interest of `roi_size`
+void
+MapFromLevel(MatchResult& match, const ScaleLevel& level, const cv::Size& roi_size)
+{
+  match.scale = level.scale;
+  match.roi = ScaleRect(match.roi, level.image_scale) & cv::Rect(0, 0, roi_size.width, roi_size.height);
+}
+
+
+/// Maps the candidates recorded by `stats` since the first `first` ones from
+/// `level` to the image coordinates, the same way as the matches (without the
+/// blur margins)
+void
+MapCandidatesFromLevel(RunStats* stats, size_t first, const ScaleLevel& level,
+    const cv::Rect& in_img_roi)
+{
+  if (!stats) {
+    return;
+  }
+  stats->MapCandidates(first, [&level, &in_img_roi](const cv::Rect& roi) {
+      cv::Rect mapped(ScaleRect(roi, level.image_scale)
+        & cv::Rect(0, 0, in_img_roi.width, in_img_roi.height));
+      mapped.x += in_img_roi.x;
+      mapped.y += in_img_roi.y;
+      return mapped;
+      });
+}
+
+} // namespace
+
+/////////////////////////////////////////////////////////////////////
+
+MaskSet::MaskSet(const std::vector<std::string>& files, const std::string& library_file,
+    const MaskHistory* history)
+{
+  if (!library_file.empty()) {
+    // The library masks refer to the mapped memory directly
+    mLibrary.reset(new MaskLibrary(library_file));
+    mMasks = mLibrary->Masks();
+  }
+
+  mMasks.reserve(mMasks.size() + files.size());
+
+  for (auto& mask_file : files) {
+    Mask mask;
+    mask.file = mask_file;
+    mask.gray = cv::imread(mask_file, 1);
+    if (mask.gray.empty()) {
+      ERROR_LOG("skipping empty/invalid mask image %s", mask_file.c_str());
+      continue;
+    }
+    // Convert mask to grayscale
+    if (mask.gray.channels() > 1) {
+      cv::cvtColor(mask.gray, mask.gray, CV_BGR2GRAY);
+    }
+
+    // Create inverted version of the mask
+    cv::bitwise_not(mask.gray, mask.inverted);
+    mask.stats = TemplateStats(mask.gray);
+
+    mMasks.push_back(mask);
+  }
+
+  if (mMasks.empty()) {
+    throw ErrorException("No valid mask images loaded");
+  }
+
+  if (history) {
+    // Try the masks matched most often first
+    history->Sort(mMasks);
+  }
+}
+
+/////////////////////////////////////////////////////////////////////
+
+Matcher::Matcher(std::shared_ptr<const MaskSet> masks, ThreadPool& pool,
+    MaskHistory* history)
+  : mMasks(masks), mPool(pool), mHistory(history)
+{
+}
+
+
+/// Searches for the masks on `gray_roi` trying all of the thresholds and scales
+/// \returns Best match with `roi` relative to the image including the blur margins
+MatchResult
+Matcher::FindBestMatch(const cv::Mat& gray_roi, const cv::Rect& in_img_roi,
+    const RunOptions& opts) const
+{
+  auto& masks = mMasks->Masks();
+  MatchResult result;
+
+  VERBOSE_LOG2("using ROI %d,%d %dx%d",
+      in_img_roi.x, in_img_roi.y, in_img_roi.width, in_img_roi.height);
+
+  // The levels are resized once and shared by all thresholds. The best MSSIM
+  // found on the previous levels lets FindPattern() skip the verification of
+  // the worse candidates.
+  const auto levels = BuildScaleLevels(gray_roi, masks, opts.scales, opts.stats);
+  const bool accept_enabled = opts.match.accept_mssim > 0;
+
+  // Thresholded images are built from the same grayscale buffer for each
+  // candidate threshold
+  for (auto threshold : opts.thresholds) {
+    for (auto& level : levels) {
+      const size_t first = opts.stats ? opts.stats->NumCandidates() : 0;
+      auto candidate = FindPattern(level.gray, threshold, level.Masks(masks), mPool,
+          opts.match, result.mssim, opts.stats);
+      MapCandidatesFromLevel(opts.stats, first, level, in_img_roi);
+      VERBOSE_LOG("threshold %f scale %f: MSSIM %f", threshold, level.scale, candidate.mssim);
+
+      if (candidate.mssim > result.mssim) {
+        result = candidate;
+        MapFromLevel(result, level, gray_roi.size());
+      }
+      if (accept_enabled && result.mssim >= opts.match.accept_mssim) {
+        break;
+      }
+    }
+    if (accept_enabled && result.mssim >= opts.match.accept_mssim) {
+      break;
+    }
+  }
+
+  if (result.mssim <= opts.min_match_mssim) {
+    throw ErrorException("Unable to find a good matching pattern");
+  }
+
+  if (mHistory) {
+    mHistory->AddHit(masks[result.mask].file);
+  }
+
+  AddBlurMargins(result.roi, in_img_roi, opts);
+  return result;
+}
+
+
+/// Searches for all occurrences of the masks on `gray_roi` trying all of the
+/// thresholds and scales. The matches found with different thresholds and
+/// scales are merged.
+/// \returns Matches with `roi` relative to the image including the blur
+/// margins sorted by MSSIM (descending)
+std::vector<MatchResult>
+Matcher::FindAllMatches(const cv::Mat& gray_roi, const cv::Rect& in_img_roi,
+    const RunOptions& opts) const
+{
+  auto& masks = mMasks->Masks();
+  std::vector<MatchResult> matches;
+  const auto levels = BuildScaleLevels(gray_roi, masks, opts.scales, opts.stats);
+
+  for (auto threshold : opts.thresholds) {
+    for (auto& level : levels) {
+      const size_t first = opts.stats ? opts.stats->NumCandidates() : 0;
+      auto found = FindPatterns(level.gray, threshold, level.Masks(masks), mPool,
+          opts.match, opts.min_match_mssim, opts.stats);
+      MapCandidatesFromLevel(opts.stats, first, level, in_img_roi);
+      VERBOSE_LOG("threshold %f scale %f: %zu match(es)", threshold, level.scale, found.size());
+
+      for (auto& match : found) {
+        MapFromLevel(match, level, gray_roi.size());
+        matches.push_back(match);
+      }
+    }
+  }
+  SuppressOverlaps(matches, opts.match.max_overlap);
+
+  if (matches.empty()) {
+    throw ErrorException("Unable to find a good matching pattern");
+  }
+
+  for (auto& match : matches) {
+    if (mHistory) {
+      mHistory->AddHit(masks[match.mask].file);
+    }
+    AddBlurMargins(match.roi, in_img_roi, opts);
+  }
+  return matches;
+}
+
+
+std::vector<MatchResult>
+Matcher::FindInRegion(const cv::Mat& gray_roi, const cv::Rect& in_img_roi,
+    const RunOptions& opts) const
+{
+  if (opts.multi) {
+    return FindAllMatches(gray_roi, in_img_roi, opts);
+  }
+  return std::vector<MatchResult>(1, FindBestMatch(gray_roi, in_img_roi, opts));
+}
+
+
+std::vector<MatchResult>
+Matcher::Find(const cv::Mat& img, const RunOptions& opts) const
+{
+  const cv::Rect in_img_roi(ResolveRoi(opts.roi, img.size()));
+  return FindInRegion(GetGrayRegion(img, in_img_roi), in_img_roi, opts);
+}
+
+
+std::vector<MatchResult>
+Matcher::Track(const cv::Mat& img, const RunOptions& opts, const MatchResult* previous) const
+{
+  const cv::Rect in_img_roi(ResolveRoi(opts.roi, img.size()));
+  cv::Rect window;
+
+  if (previous) {
+    // Window around the previous match without the blur margins
+    const cv::Rect& roi = previous->roi;
+    const int radius = opts.track_radius;
+    window = cv::Rect(roi.x + opts.blur_margin[3] - radius,
+        roi.y + opts.blur_margin[0] - radius,
+        roi.width - opts.blur_margin[1] - opts.blur_margin[3] + 2 * radius,
+        roi.height - opts.blur_margin[2] - opts.blur_margin[0] + 2 * radius);
+    window &= in_img_roi;
+  }
+
+  if (previous && window.area() > 0) {
+    // The object is expected to keep its threshold and scale
+    RunOptions track_opts(opts);
+    track_opts.thresholds.assign(1, previous->threshold);
+    track_opts.scales.assign(1, previous->scale);
+
+    try {
+      return std::vector<MatchResult>(1,
+          FindBestMatch(GetGrayRegion(img, window), window, track_opts));
+    } catch (ErrorException& e) {
+      VERBOSE_LOG("lost track of the match: %s", e.what());
+    }
+  }
+
+  return FindInRegion(GetGrayRegion(img, in_img_roi), in_img_roi, opts);
+}
+
+
+std::vector<MatchResult>
+Matcher::ProcessFile(const std::string& input_file, const std::string& output_file,
+    const RunOptions& opts) const
+{
+  cv::Mat gray_roi;
+  cv::Rect in_img_roi;
+  cv::Mat out_img;
+
+  // Decode only the ROI scanlines if possible. Otherwise decode the whole
+  // image which is then reused for the output.
+  {
+    StageTimer timer(opts.stats, RunStats::kDecode);
+    if (!ReadGrayRegion(input_file, opts.roi, gray_roi, in_img_roi)) {
+      out_img = ReadImage(input_file);
+      timer.Add(out_img);
+
+      in_img_roi = ResolveRoi(opts.roi, out_img.size());
+      gray_roi = GetGrayRegion(out_img, in_img_roi);
+    } else {
+      timer.Add(gray_roi);
+    }
+  }
+
+  auto matches = FindInRegion(gray_roi, in_img_roi, opts);
+  if (!opts.dry_run) {
+    Redactor().Write(input_file, output_file, out_img, matches, opts);
+  }
+  return matches;
+}
+
+/////////////////////////////////////////////////////////////////////
+
+void
+Redactor::Redact(cv::Mat& img, const std::vector<MatchResult>& matches,
+    const RunOptions& opts) const
+{
+  for (auto& match : matches) {
+    cv::Mat region(img(match.roi));
+    RedactRegion(region, opts);
+  }
+}
+
+
+void
+Redactor::Write(const std::string& input_file, const std::string& output_file,
+    cv::Mat& img, const std::vector<MatchResult>& matches, const RunOptions& opts) const
+{
+  std::vector<cv::Rect> rects;
+  for (auto& match : matches) {
+    VERBOSE_LOG("writing to file %s using threshold %f MSSIM %f roi %d,%d,%d,%d",
+        output_file.c_str(), match.threshold, match.mssim,
+        match.roi.x, match.roi.y, match.roi.width, match.roi.height);
+    rects.push_back(match.roi);
+  }
+
+  // Re-encode only the MCUs touched by the blur. The decoding of the strip
+  // is accounted as the write stage.
+  if (opts.jpeg_region_write && !input_file.empty() && IsJpegFilename(output_file)) {
+    StageTimer timer(opts.stats, RunStats::kWrite);
+    if (RewriteJpegRegions(input_file, output_file, rects, GetRedactRadius(opts.redact),
+          [&opts](cv::Mat& region) { RedactRegion(region, opts); })) {
+      for (auto& rect : rects) {
+        timer.Add(0, rect.area());
+      }
+      return;
+    }
+  }
+
+  if (img.empty()) {
+    StageTimer timer(opts.stats, RunStats::kDecode);
+    img = ReadImage(input_file);
+    timer.Add(img);
+  }
+  Redact(img, matches, opts);
+
+  StageTimer timer(opts.stats, RunStats::kWrite);
+  timer.Add(img);
+  if (!cv::imwrite(output_file, img)) {
+    throw ErrorException("failed to save to file " + output_file);
+  }
+}
+
+
+void
+Redactor::Encode(const cv::Mat& img, const std::string& format,
+    std::vector<unsigned char>& output, const RunOptions& opts) const
+{
+  StageTimer timer(opts.stats, RunStats::kWrite);
+  timer.Add(img);
+  if (!cv::imencode(format, img, output)) {
+    throw ErrorException("failed to encode output image as " + format);
+  }
+}
+
+/////////////////////////////////////////////////////////////////////
+
+cv::Mat
+ReadImage(const std::string& filename)
+{
+  cv::Mat img(cv::imread(filename, 1));
+  if (img.empty()) {
+    throw ErrorException("failed to read input image " + filename);
+  }
+  return img;
+}
+
+
+cv::Mat
+DecodeImage(const unsigned char* data, size_t size, RunStats* stats)
+{
+  StageTimer timer(stats, RunStats::kDecode);
+
+  // The header refers to the caller's bytes, which are only read
+  const cv::Mat encoded(1, static_cast<int>(size), CV_8UC1, const_cast<unsigned char*>(data));
+  cv::Mat img(cv::imdecode(encoded, 1));
+  if (img.empty()) {
+    throw ErrorException("failed to decode input image");
+  }
+  timer.Add(img);
+  return img;
+}
+
+
+cv::Mat
+WrapPixels(unsigned char* data, int width, int height, int channels, size_t step)
+{
+  if (channels != 1 && channels != 3) {
+    throw ErrorException("unsupported number of channels %d", channels);
+  }
+  return cv::Mat(height, width, CV_8UC(channels), data, step);
+}
+
+
+cv::Mat
+GetGrayRegion(const cv::Mat& img, const cv::Rect& roi)
+{
+  cv::Mat gray;
+  if (img.channels() > 1) {
+    cv::cvtColor(img(roi), gray, CV_BGR2GRAY);
+  } else {
+    gray = img(roi);
+  }
+  return gray;
+}
+
+// vim: et ts=2 sts=2 sw=2
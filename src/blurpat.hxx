@@ -0,0 +1,171 @@
+/* \file
+ *
+ * \copyright Copyright © 2015  Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#pragma once
+#ifndef BLURPAT_HXX
+#define BLURPAT_HXX
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+#include "mask_history.hxx"
+#include "mask_library.hxx"
+#include "matcher.hxx"
+#include "redact.hxx"
+#include "stats.hxx"
+#include "thread_pool.hxx"
+
+/// Parameters of processing a single image
+struct RunOptions {
+  /// Region of interest as the -r option (see ResolveRoi())
+  cv::Rect roi{0, 0, 1000000, 1000000};
+  /// Top, right, bottom, left
+  int blur_margin[4]{0,0,0,0};
+  std::vector<double> thresholds{80.};
+  /// Scales of the masks (only the original size if empty)
+  std::vector<double> scales;
+  double min_match_mssim{0.1};
+  RedactOptions redact;
+  bool dry_run{false};
+  bool jpeg_region_write{false};
+  /// Whether all occurrences of the masks are redacted
+  bool multi{false};
+  /// Distance in pixels from the previous match searched by Matcher::Track()
+  int track_radius{32};
+  MatchOptions match;
+  /// Statistics collected if not `NULL`
+  RunStats* stats{NULL};
+};
+
+/// Immutable set of masks shared by Matcher objects (and threads)
+class MaskSet
+{
+  public:
+    /// Loads masks from library `library_file` (if not empty) and mask images
+    /// `files` computing grayscale and inverted versions of the latter.
+    /// Invalid mask images are skipped. Throws ErrorException if no masks
+    /// are loaded.
+    /// \param history If not `NULL`, the masks are ordered by the numbers of
+    /// matches
+    MaskSet(const std::vector<std::string>& files, const std::string& library_file,
+        const MaskHistory* history = NULL);
+
+    MaskSet(const MaskSet&) = delete;
+    MaskSet& operator=(const MaskSet&) = delete;
+
+    const std::vector<Mask>& Masks() const { return mMasks; }
+
+  private:
+    /// Mapped mask library referred by `mMasks`
+    std::unique_ptr<MaskLibrary> mLibrary;
+    std::vector<Mask> mMasks;
+};
+
+/// Searches for the masks on images.
+///
+/// The methods are const and may be called concurrently, also on different
+/// Matcher objects sharing the masks and the pool.
+class Matcher
+{
+  public:
+    /// \param pool Pool running the matching jobs. Must outlive the matcher.
+    /// \param history Match counts updated by each match (optional)
+    Matcher(std::shared_ptr<const MaskSet> masks, ThreadPool& pool,
+        MaskHistory* history = NULL);
+
+    /// Searches for the masks on the ROI of decoded image `img`
+    /// \param img 8-bit BGR or grayscale image
+    /// \returns The best match, or all of the matches in `opts.multi` mode,
+    /// sorted by MSSIM (descending) with `roi` relative to the image including
+    /// the blur margins. Throws ErrorException if nothing is found.
+    std::vector<MatchResult> Find(const cv::Mat& img, const RunOptions& opts) const;
+
+    /// The same as Find() for grayscale region `gray_roi` located at
+    /// `in_img_roi` within the image
+    std::vector<MatchResult> FindInRegion(const cv::Mat& gray_roi,
+        const cv::Rect& in_img_roi, const RunOptions& opts) const;
+
+    /// Searches for the masks on frame `img` within `opts.track_radius` pixels
+    /// around the `previous` match (returned for the previous frame) first.
+    /// Falls back to Find() if `previous` is `NULL`, or the match is lost.
+    std::vector<MatchResult> Track(const cv::Mat& img, const RunOptions& opts,
+        const MatchResult* previous) const;
+
+    /// Searches for the masks on `input_file`, redacts the matches and writes
+    /// the result to `output_file` (unless `opts.dry_run` is set). Only the
+    /// ROI is decoded for the search if possible.
+    std::vector<MatchResult> ProcessFile(const std::string& input_file,
+        const std::string& output_file, const RunOptions& opts) const;
+
+    const MaskSet& Masks() const { return *mMasks; }
+
+  private:
+    MatchResult FindBestMatch(const cv::Mat& gray_roi, const cv::Rect& in_img_roi,
+        const RunOptions& opts) const;
+    std::vector<MatchResult> FindAllMatches(const cv::Mat& gray_roi,
+        const cv::Rect& in_img_roi, const RunOptions& opts) const;
+
+    std::shared_ptr<const MaskSet> mMasks;
+    ThreadPool& mPool;
+    MaskHistory* mHistory;
+};
+
+/// Obscures the matches found by Matcher. Has no state, so the methods may be
+/// called concurrently.
+class Redactor
+{
+  public:
+    /// Redacts `matches` on `img` in place. `img` may refer to caller-owned
+    /// pixels (see WrapPixels()).
+    void Redact(cv::Mat& img, const std::vector<MatchResult>& matches,
+        const RunOptions& opts) const;
+
+    /// Redacts `matches` of `input_file` and writes the result to
+    /// `output_file`. With `opts.jpeg_region_write` only the touched MCUs of
+    /// JPEG images are re-encoded.
+    /// \param input_file Source of `img`. May be empty if `img` is given.
+    /// \param img Decoded `input_file`, or empty matrix if it is not decoded
+    /// yet. The matches are redacted in place.
+    void Write(const std::string& input_file, const std::string& output_file,
+        cv::Mat& img, const std::vector<MatchResult>& matches,
+        const RunOptions& opts) const;
+
+    /// Encodes `img` in `format` (file extension, e.g. ".jpg") into `output`
+    void Encode(const cv::Mat& img, const std::string& format,
+        std::vector<unsigned char>& output, const RunOptions& opts) const;
+};
+
+/// Reads image file forcing 3 channels
+cv::Mat ReadImage(const std::string& filename);
+
+/// Decodes caller-owned encoded image bytes forcing 3 channels. The bytes are
+/// not copied.
+cv::Mat DecodeImage(const unsigned char* data, size_t size, RunStats* stats = NULL);
+
+/// Wraps caller-owned 8-bit pixels (1 or 3 channels in BGR order, `step`
+/// bytes per row) without copying them. The pixels must outlive the matrix.
+cv::Mat WrapPixels(unsigned char* data, int width, int height, int channels, size_t step);
+
+/// Converts region `roi` of `img` to grayscale
+cv::Mat GetGrayRegion(const cv::Mat& img, const cv::Rect& roi);
+
+#endif // BLURPAT_HXX
+// vim: et ts=2 sts=2 sw=2
@@ -0,0 +1,354 @@
+/* \file
+ *
+ * \copyright Copyright © 2015  Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include <csetjmp>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+
+#if defined(HAVE_LIBJPEG)
+# include <jpeglib.h>
+#endif
+#if defined(HAVE_LIBPNG)
+# include <png.h>
+#endif
+
+#include "exceptions.hxx"
+#include "image_reader.hxx"
+
+/////////////////////////////////////////////////////////////////////
+
+namespace {
+
+/// Closes FILE on scope exit
+struct FileCloser {
+  void operator()(FILE* fp) const { if (fp) fclose(fp); }
+};
+typedef std::unique_ptr<FILE, FileCloser> FilePtr;
+
+
+enum class ImageFormat { kUnknown, kJpeg, kPng };
+
+
+ImageFormat
+DetectFormat(FILE* fp)
+{
+  unsigned char sig[8];
+  const size_t n = fread(sig, 1, sizeof(sig), fp);
+  rewind(fp);
+
+  if (n >= 3 && sig[0] == 0xFF && sig[1] == 0xD8 && sig[2] == 0xFF) {
+    return ImageFormat::kJpeg;
+  }
+  static const unsigned char kPngSig[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+  if (n == sizeof(kPngSig) && memcmp(sig, kPngSig, sizeof(kPngSig)) == 0) {
+    return ImageFormat::kPng;
+  }
+  return ImageFormat::kUnknown;
+}
+
+
+#if defined(HAVE_LIBJPEG)
+struct JpegErrorManager {
+  jpeg_error_mgr pub;
+  jmp_buf jmp;
+  char message[JMSG_LENGTH_MAX];
+};
+
+
+void
+JpegErrorExit(j_common_ptr cinfo)
+{
+  auto err = reinterpret_cast<JpegErrorManager*>(cinfo->err);
+  (*cinfo->err->format_message)(cinfo, err->message);
+  longjmp(err->jmp, 1);
+}
+
+
+/// \returns Orientation stored in the Exif marker saved by jpeg_save_markers()
+int
+GetJpegOrientation(j_decompress_ptr cinfo)
+{
+  for (jpeg_saved_marker_ptr marker = cinfo->marker_list; marker; marker = marker->next) {
+    // APP1 may also hold XMP data
+    if (marker->marker == JPEG_APP0 + 1) {
+      const int orientation = GetExifOrientation(marker->data, marker->data_length);
+      if (orientation != 1) {
+        return orientation;
+      }
+    }
+  }
+  return 1;
+}
+
+
+/// Decodes region of JPEG file into `strip` which is allocated by the caller:
+/// a local object modified after setjmp() would be indeterminate after
+/// longjmp(), and its destructor would run while the exception propagates.
+/// Only trivially destructible locals are used.
+/// \param gray Decoded pixels of `region` referring to `strip`
+/// \returns `false` for color spaces having no direct conversion to gray and
+/// for images with Exif orientation (cv::imread() rotates them)
+bool
+ReadJpegGrayRegion(FILE* fp, const cv::Rect& roi, cv::Mat& strip, cv::Mat& gray,
+    cv::Rect& region)
+{
+  jpeg_decompress_struct cinfo;
+  JpegErrorManager jerr;
+  cv::Size size;
+  bool supported = false;
+
+  // Destroying zeroed structure is a no-op
+  memset(&cinfo, 0, sizeof(cinfo));
+  cinfo.err = jpeg_std_error(&jerr.pub);
+  jerr.pub.error_exit = JpegErrorExit;
+  jerr.message[0] = '\0';
+
+  if (setjmp(jerr.jmp)) {
+    jpeg_destroy_decompress(&cinfo);
+    throw ErrorException("failed to decode JPEG: %s", jerr.message);
+  }
+
+  jpeg_create_decompress(&cinfo);
+  jpeg_stdio_src(&cinfo, fp);
+  jpeg_save_markers(&cinfo, JPEG_APP0 + 1, 0xFFFF);
+  jpeg_read_header(&cinfo, TRUE);
+
+  size.width = cinfo.image_width;
+  size.height = cinfo.image_height;
+  {
+    cv::Rect tmp_roi(roi);
+    if (tmp_roi.x < 0) tmp_roi.x += size.width;
+    if (tmp_roi.y < 0) tmp_roi.y += size.height;
+    region = tmp_roi & cv::Rect(0, 0, size.width, size.height);
+  }
+
+  // CMYK and YCCK images are left to the full decoder, and so are rotated
+  // images, since the ROI refers to the rotated image
+  supported = (cinfo.jpeg_color_space == JCS_GRAYSCALE
+      || cinfo.jpeg_color_space == JCS_YCbCr
+      || cinfo.jpeg_color_space == JCS_RGB)
+    && GetJpegOrientation(&cinfo) == 1;
+
+  if (supported && region.area() > 0) {
+    cinfo.out_color_space = JCS_GRAYSCALE;
+    jpeg_start_decompress(&cinfo);
+
+    // Columns are cropped to iMCU boundaries, the rest is cropped below
+    JDIMENSION xoffset = region.x;
+    JDIMENSION crop_width = region.width;
+#if defined(HAVE_JPEG_CROP_SCANLINE)
+    jpeg_crop_scanline(&cinfo, &xoffset, &crop_width);
+#else
+    xoffset = 0;
+    crop_width = cinfo.output_width;
+#endif
+
+#if defined(HAVE_JPEG_SKIP_SCANLINES)
+    jpeg_skip_scanlines(&cinfo, region.y);
+#endif
+
+    strip.create(region.height, static_cast<int>(crop_width), CV_8UC1);
+    while (cinfo.output_scanline < static_cast<JDIMENSION>(region.y + region.height)) {
+      const int y = static_cast<int>(cinfo.output_scanline) - region.y;
+      JSAMPROW row = y >= 0 ? strip.ptr<uchar>(y) : strip.ptr<uchar>(0);
+      jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+
+    gray = strip(cv::Rect(region.x - static_cast<int>(xoffset), 0,
+          region.width, region.height));
+  }
+
+  // The rest of the image is not needed
+  jpeg_abort_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+
+  if (supported && region.area() == 0) {
+    ResolveRoi(roi, size);
+  }
+  return supported;
+}
+#endif // HAVE_LIBJPEG
+
+
+#if defined(HAVE_LIBPNG)
+/// Decodes region of non-interlaced PNG file into `strip` allocated by the
+/// caller, see ReadJpegGrayRegion()
+/// \param gray Decoded pixels of `region` referring to `strip`
+/// \returns `false` for interlaced images
+bool
+ReadPngGrayRegion(FILE* fp, const cv::Rect& roi, cv::Mat& strip, cv::Mat& gray,
+    cv::Rect& region)
+{
+  png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  if (!png) {
+    throw ErrorException("failed to create PNG read struct");
+  }
+  png_infop info = png_create_info_struct(png);
+  cv::Size size;
+  bool interlaced = false;
+
+  if (!info || setjmp(png_jmpbuf(png))) {
+    png_destroy_read_struct(&png, &info, NULL);
+    throw ErrorException("failed to decode PNG");
+  }
+
+  png_init_io(png, fp);
+  png_read_info(png, info);
+
+  const png_byte color_type = png_get_color_type(png, info);
+  interlaced = png_get_interlace_type(png, info) != PNG_INTERLACE_NONE;
+  size.width = png_get_image_width(png, info);
+  size.height = png_get_image_height(png, info);
+
+  {
+    cv::Rect tmp_roi(roi);
+    if (tmp_roi.x < 0) tmp_roi.x += size.width;
+    if (tmp_roi.y < 0) tmp_roi.y += size.height;
+    region = tmp_roi & cv::Rect(0, 0, size.width, size.height);
+  }
+
+  if (!interlaced && region.area() > 0) {
+    // Same conversions as cv::imread() followed by cv::cvtColor()
+    png_set_strip_16(png);
+    png_set_strip_alpha(png);
+    if (color_type == PNG_COLOR_TYPE_PALETTE) {
+      png_set_palette_to_rgb(png);
+    }
+    if (color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA) {
+      png_set_expand_gray_1_2_4_to_8(png);
+    } else {
+      png_set_rgb_to_gray_fixed(png, 1, 29900, 58700);
+    }
+    png_read_update_info(png, info);
+
+    // Rows above the region are still decompressed, but not stored
+    // The extra row receives the rows above the region
+    strip.create(region.height + 1, size.width, CV_8UC1);
+    for (int y = 0; y < region.y + region.height; ++y) {
+      const int strip_y = y < region.y ? region.height : y - region.y;
+      png_read_row(png, strip.ptr<uchar>(strip_y), NULL);
+    }
+    gray = strip(cv::Rect(region.x, 0, region.width, region.height));
+  }
+
+  png_destroy_read_struct(&png, &info, NULL);
+
+  if (!interlaced && region.area() == 0) {
+    ResolveRoi(roi, size);
+  }
+  return !interlaced;
+}
+#endif // HAVE_LIBPNG
+
+} // namespace
+
+/////////////////////////////////////////////////////////////////////
+
+int
+GetExifOrientation(const unsigned char* data, size_t size)
+{
+  // "Exif\0\0" followed by TIFF header: byte order, 42, offset of IFD0
+  const size_t kTiff = 6;
+  if (size < kTiff + 8 || memcmp(data, "Exif\0\0", kTiff) != 0) {
+    return 1;
+  }
+  const unsigned char* tiff = data + kTiff;
+  const size_t tiff_size = size - kTiff;
+  const bool big_endian = tiff[0] == 'M' && tiff[1] == 'M';
+  if (!big_endian && !(tiff[0] == 'I' && tiff[1] == 'I')) {
+    return 1;
+  }
+
+  auto get16 = [&](size_t offset) -> unsigned {
+    return big_endian ? (tiff[offset] << 8) | tiff[offset + 1]
+      : tiff[offset] | (tiff[offset + 1] << 8);
+  };
+  auto get32 = [&](size_t offset) -> size_t {
+    return big_endian ? (get16(offset) << 16) | get16(offset + 2)
+      : get16(offset) | (get16(offset + 2) << 16);
+  };
+
+  const size_t ifd = get32(4);
+  if (get16(2) != 42 || ifd > tiff_size - 2) {
+    return 1;
+  }
+  const size_t count = get16(ifd);
+  for (size_t i = 0; i < count; ++i) {
+    const size_t entry = ifd + 2 + i * 12;
+    if (entry + 12 > tiff_size) {
+      break;
+    }
+    // Tag 0x0112 of type SHORT
+    if (get16(entry) == 0x0112 && get16(entry + 2) == 3) {
+      const unsigned orientation = get16(entry + 8);
+      return orientation >= 1 && orientation <= 8 ? orientation : 1;
+    }
+  }
+  return 1;
+}
+
+
+cv::Rect
+ResolveRoi(const cv::Rect& roi, const cv::Size& size)
+{
+  cv::Rect tmp_roi(roi);
+  if (tmp_roi.x < 0) tmp_roi.x = size.width + tmp_roi.x;
+  if (tmp_roi.y < 0) tmp_roi.y = size.height + tmp_roi.y;
+
+  cv::Rect region(tmp_roi & cv::Rect(0, 0, size.width, size.height));
+  if (region.area() == 0) {
+    throw ErrorException("ROI %d,%d %dx%d is out of bounds",
+        tmp_roi.x, tmp_roi.y, tmp_roi.width, tmp_roi.height);
+  }
+  return region;
+}
+
+
+bool
+ReadGrayRegion(const std::string& filename, const cv::Rect& roi,
+    cv::Mat& gray, cv::Rect& region)
+{
+#if !defined(HAVE_LIBJPEG) && !defined(HAVE_LIBPNG)
+  (void) roi;
+  (void) gray;
+  (void) region;
+#endif
+
+  FilePtr fp(fopen(filename.c_str(), "rb"));
+  if (!fp) {
+    throw ErrorException("failed to open input image " + filename);
+  }
+
+  // Pixel buffer of the decoders, `gray` refers to its part
+  cv::Mat strip;
+
+  switch (DetectFormat(fp.get())) {
+#if defined(HAVE_LIBJPEG)
+    case ImageFormat::kJpeg:
+      return ReadJpegGrayRegion(fp.get(), roi, strip, gray, region);
+#endif
+#if defined(HAVE_LIBPNG)
+    case ImageFormat::kPng:
+      return ReadPngGrayRegion(fp.get(), roi, strip, gray, region);
+#endif
+    default:
+      return false;
+  }
+}
+
+// vim: et ts=2 sts=2 sw=2
@@ -0,0 +1,53 @@
+/* \file
+ *
+ * \copyright Copyright © 2015  Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#pragma once
+#ifndef IMAGE_READER_HXX
+#define IMAGE_READER_HXX
+
+#include <cstddef>
+#include <string>
+
+#include <opencv2/core/core.hpp>
+
+/// Resolves region of interest given as the -r option (negative x and y are
+/// relative to the right and bottom edges) against image of size `size`.
+/// Throws ErrorException, if the region is out of bounds.
+cv::Rect ResolveRoi(const cv::Rect& roi, const cv::Size& size);
+
+/// Returns orientation (1..8) stored in Exif APP1 marker payload `data`, or 1
+/// if there is no valid orientation tag.
+int GetExifOrientation(const unsigned char* data, size_t size);
+
+/// Decodes grayscale pixels of a region of interest of image file.
+///
+/// Only the scanlines covering the region are decoded. JPEG scanlines are
+/// decoded straight to luminance (skipping the chroma upsampling and color
+/// conversion), PNG rows are converted to gray by libpng.
+/// \param filename Image file
+/// \param roi Region of interest as the -r option
+/// \param gray Decoded pixels of the resolved region
+/// \param region Resolved region in image coordinates
+/// \returns `false`, if partial decoding is not supported for the file (the
+/// caller should decode the whole image). This includes JPEG files with Exif
+/// orientation other than 1, since cv::imread() returns them rotated. Throws
+/// ErrorException on errors.
+bool ReadGrayRegion(const std::string& filename, const cv::Rect& roi,
+    cv::Mat& gray, cv::Rect& region);
+
+#endif // IMAGE_READER_HXX
+// vim: et ts=2 sts=2 sw=2
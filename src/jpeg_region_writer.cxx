@@ -0,0 +1,492 @@
+/* \file
+ *
+ * \copyright Copyright © 2015  Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <csetjmp>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+
+#if defined(HAVE_LIBJPEG)
+# include <jpeglib.h>
+#endif
+
+#include "atomic_file.hxx"
+#include "exceptions.hxx"
+#include "image_reader.hxx"
+#include "jpeg_region_writer.hxx"
+
+/////////////////////////////////////////////////////////////////////
+
+#if defined(HAVE_LIBJPEG)
+namespace {
+
+struct FileCloser {
+  void operator()(FILE* fp) const { if (fp) fclose(fp); }
+};
+typedef std::unique_ptr<FILE, FileCloser> FilePtr;
+
+
+struct JpegErrorManager {
+  jpeg_error_mgr pub;
+  jmp_buf jmp;
+  char message[JMSG_LENGTH_MAX];
+};
+
+
+void
+JpegErrorExit(j_common_ptr cinfo)
+{
+  auto err = reinterpret_cast<JpegErrorManager*>(cinfo->err);
+  (*cinfo->err->format_message)(cinfo, err->message);
+  longjmp(err->jmp, 1);
+}
+
+
+void
+InitErrorManager(JpegErrorManager& jerr)
+{
+  jpeg_std_error(&jerr.pub);
+  jerr.pub.error_exit = JpegErrorExit;
+  jerr.message[0] = '\0';
+}
+
+
+/// Regions of the image re-encoded from pixels
+struct RegionLayout {
+  cv::Size image_size;
+  /// MCU size in pixels
+  cv::Size mcu_size;
+  /// Rectangles to modify clipped to the image
+  std::vector<cv::Rect> rects;
+  /// `rects` expanded to MCU boundaries (may exceed the image on the right
+  /// and bottom edges)
+  std::vector<cv::Rect> mcu_rects;
+  /// Decoded pixels: bounding box of `mcu_rects` plus context clipped to the
+  /// image
+  cv::Rect strip_rect;
+};
+
+
+/// Decodes BGR pixels of `layout.strip_rect` computing the layout of `rects`
+/// from the JPEG header. The pixels are decoded into `decoded` allocated by the
+/// caller, since a local object modified after setjmp() would be
+/// indeterminate after longjmp().
+/// \param strip Pixels of `layout.strip_rect` referring to `decoded`
+/// \returns `false` for unsupported color spaces and for images with Exif
+/// orientation (the regions refer to the rotated image)
+bool
+DecodeStrip(FILE* fp, const std::vector<cv::Rect>& rects, int context,
+    RegionLayout& layout, cv::Mat& decoded, cv::Mat& strip)
+{
+  jpeg_decompress_struct cinfo;
+  JpegErrorManager jerr;
+  bool supported = false;
+
+  // Destroying zeroed structure is a no-op
+  memset(&cinfo, 0, sizeof(cinfo));
+  cinfo.err = &jerr.pub;
+  InitErrorManager(jerr);
+  layout.rects = rects;
+  layout.mcu_rects.resize(rects.size());
+
+  if (setjmp(jerr.jmp)) {
+    jpeg_destroy_decompress(&cinfo);
+    throw ErrorException("failed to decode JPEG: %s", jerr.message);
+  }
+
+  jpeg_create_decompress(&cinfo);
+  jpeg_stdio_src(&cinfo, fp);
+  jpeg_save_markers(&cinfo, JPEG_APP0 + 1, 0xFFFF);
+  jpeg_read_header(&cinfo, TRUE);
+
+  supported = (cinfo.jpeg_color_space == JCS_YCbCr && cinfo.num_components == 3)
+    || (cinfo.jpeg_color_space == JCS_GRAYSCALE && cinfo.num_components == 1);
+  for (auto marker = cinfo.marker_list; supported && marker; marker = marker->next) {
+    supported = marker->marker != JPEG_APP0 + 1
+      || GetExifOrientation(marker->data, marker->data_length) == 1;
+  }
+
+  if (supported) {
+    layout.image_size = cv::Size(cinfo.image_width, cinfo.image_height);
+    layout.mcu_size = cv::Size(DCTSIZE * cinfo.max_h_samp_factor,
+        DCTSIZE * cinfo.max_v_samp_factor);
+
+    const cv::Size& mcu = layout.mcu_size;
+    int bx0 = layout.image_size.width, by0 = layout.image_size.height, bx1 = 0, by1 = 0;
+    for (size_t i = 0; i < layout.rects.size(); ++i) {
+      cv::Rect& rect = layout.rects[i];
+      rect &= cv::Rect(0, 0, layout.image_size.width, layout.image_size.height);
+      if (rect.area() == 0) {
+        continue;
+      }
+
+      const int x0 = rect.x / mcu.width * mcu.width;
+      const int y0 = rect.y / mcu.height * mcu.height;
+      const int x1 = (rect.x + rect.width + mcu.width - 1) / mcu.width * mcu.width;
+      const int y1 = (rect.y + rect.height + mcu.height - 1) / mcu.height * mcu.height;
+      layout.mcu_rects[i] = cv::Rect(x0, y0, x1 - x0, y1 - y0);
+
+      bx0 = std::min(bx0, x0);
+      by0 = std::min(by0, y0);
+      bx1 = std::max(bx1, x1);
+      by1 = std::max(by1, y1);
+    }
+
+    if (bx0 < bx1 && by0 < by1) {
+      const int sx0 = std::max(0, bx0 - context);
+      const int sy0 = std::max(0, by0 - context);
+      const int sx1 = std::min(layout.image_size.width, bx1 + context);
+      const int sy1 = std::min(layout.image_size.height, by1 + context);
+      layout.strip_rect = cv::Rect(sx0, sy0, sx1 - sx0, sy1 - sy0);
+    }
+  }
+
+  if (supported && layout.strip_rect.area() > 0) {
+#if defined(JCS_EXTENSIONS)
+    cinfo.out_color_space = JCS_EXT_BGR;
+#else
+    cinfo.out_color_space = JCS_RGB;
+#endif
+    jpeg_start_decompress(&cinfo);
+
+    JDIMENSION xoffset = layout.strip_rect.x;
+    JDIMENSION width = layout.strip_rect.width;
+#if defined(HAVE_JPEG_CROP_SCANLINE)
+    jpeg_crop_scanline(&cinfo, &xoffset, &width);
+#else
+    xoffset = 0;
+    width = cinfo.output_width;
+#endif
+#if defined(HAVE_JPEG_SKIP_SCANLINES)
+    jpeg_skip_scanlines(&cinfo, layout.strip_rect.y);
+#endif
+
+    // The rows above the strip go to a row of the decoder's pool rather than
+    // to `decoded`: the filters read the pixels of the parent matrix beyond
+    // the strip, so `decoded` must contain nothing but the strip.
+    decoded.create(layout.strip_rect.height, static_cast<int>(width), CV_8UC3);
+    JSAMPARRAY skipped = (*cinfo.mem->alloc_sarray)(reinterpret_cast<j_common_ptr>(&cinfo),
+        JPOOL_IMAGE, width * cinfo.output_components, 1);
+    const JDIMENSION end = layout.strip_rect.y + layout.strip_rect.height;
+    while (cinfo.output_scanline < end) {
+      const int y = static_cast<int>(cinfo.output_scanline) - layout.strip_rect.y;
+      JSAMPROW row = y >= 0 ? decoded.ptr<uchar>(y) : skipped[0];
+      jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+
+#if !defined(JCS_EXTENSIONS)
+    for (int y = 0; y < layout.strip_rect.height; ++y) {
+      uchar* p = decoded.ptr<uchar>(y);
+      for (JDIMENSION x = 0; x < width; ++x, p += 3) {
+        std::swap(p[0], p[2]);
+      }
+    }
+#endif
+
+    strip = decoded(cv::Rect(layout.strip_rect.x - static_cast<int>(xoffset), 0,
+          layout.strip_rect.width, layout.strip_rect.height));
+  }
+
+  jpeg_abort_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+  return supported;
+}
+
+
+const double kPi = 3.14159265358979323846;
+
+
+/// 8x8 forward DCT basis: cos((2x + 1) * u * pi / 16) * C(u) / 2
+struct DctTable {
+  float c[DCTSIZE][DCTSIZE];
+
+  DctTable()
+  {
+    for (int u = 0; u < DCTSIZE; ++u) {
+      const double cu = u == 0 ? std::sqrt(0.5) : 1.;
+      for (int x = 0; x < DCTSIZE; ++x) {
+        c[u][x] = static_cast<float>(cu / 2 * std::cos((2 * x + 1) * u * kPi / 16));
+      }
+    }
+  }
+};
+
+const DctTable g_dct;
+
+
+/// Converts samples (level shifted by 128) into quantized coefficients
+void
+EncodeBlock(const float samples[DCTSIZE2], const JQUANT_TBL* qtbl, JCOEF* block)
+{
+  float tmp[DCTSIZE2];
+
+  // Rows
+  for (int y = 0; y < DCTSIZE; ++y) {
+    for (int u = 0; u < DCTSIZE; ++u) {
+      float sum = 0.f;
+      for (int x = 0; x < DCTSIZE; ++x) {
+        sum += g_dct.c[u][x] * samples[y * DCTSIZE + x];
+      }
+      tmp[y * DCTSIZE + u] = sum;
+    }
+  }
+  // Columns. Both the coefficients and the table are in natural order.
+  for (int v = 0; v < DCTSIZE; ++v) {
+    for (int u = 0; u < DCTSIZE; ++u) {
+      float sum = 0.f;
+      for (int y = 0; y < DCTSIZE; ++y) {
+        sum += g_dct.c[v][y] * tmp[y * DCTSIZE + u];
+      }
+      const int k = v * DCTSIZE + u;
+      block[k] = static_cast<JCOEF>(std::lround(sum / qtbl->quantval[k]));
+    }
+  }
+}
+
+
+/// Computes component `ci` of BGR pixel
+inline float
+ComponentValue(const uchar* bgr, int ci, int num_components)
+{
+  const float b = bgr[0], g = bgr[1], r = bgr[2];
+
+  if (num_components == 1 || ci == 0) {
+    return 0.299f * r + 0.587f * g + 0.114f * b;
+  }
+  if (ci == 1) {
+    return -0.168736f * r - 0.331264f * g + 0.5f * b + 128.f;
+  }
+  return 0.5f * r - 0.418688f * g - 0.081312f * b + 128.f;
+}
+
+
+/// Re-encodes blocks of `mcu_rect` of component `ci` from `strip`.
+/// Pixels beyond the image edges replicate the edge pixels. Only POD locals,
+/// since libjpeg may longjmp out of here.
+void
+EncodeComponent(j_decompress_ptr cinfo, jvirt_barray_ptr coef, int ci,
+    const RegionLayout& layout, const cv::Rect& mcu_rect, const cv::Mat& strip)
+{
+  const jpeg_component_info* comp = &cinfo->comp_info[ci];
+  const JQUANT_TBL* qtbl = comp->quant_table;
+  // Pixels per component sample
+  const int sx = cinfo->max_h_samp_factor / comp->h_samp_factor;
+  const int sy = cinfo->max_v_samp_factor / comp->v_samp_factor;
+  const int block_w = DCTSIZE * sx;
+  const int block_h = DCTSIZE * sy;
+  const int bx0 = mcu_rect.x / block_w;
+  const int by0 = mcu_rect.y / block_h;
+  const int bx1 = std::min<int>((mcu_rect.x + mcu_rect.width) / block_w,
+      comp->width_in_blocks);
+  const int by1 = std::min<int>((mcu_rect.y + mcu_rect.height) / block_h,
+      comp->height_in_blocks);
+  const int max_x = layout.image_size.width - 1;
+  const int max_y = layout.image_size.height - 1;
+  const float scale = 1.f / (sx * sy);
+  float samples[DCTSIZE2];
+
+  for (int by = by0; by < by1; ++by) {
+    JBLOCKARRAY rows = (*cinfo->mem->access_virt_barray)(
+        reinterpret_cast<j_common_ptr>(cinfo), coef, by, 1, TRUE);
+
+    for (int bx = bx0; bx < bx1; ++bx) {
+      for (int v = 0; v < DCTSIZE; ++v) {
+        for (int u = 0; u < DCTSIZE; ++u) {
+          float sum = 0.f;
+          for (int dy = 0; dy < sy; ++dy) {
+            const int y = std::min((by * DCTSIZE + v) * sy + dy, max_y);
+            const uchar* row = strip.ptr<uchar>(y - layout.strip_rect.y);
+            for (int dx = 0; dx < sx; ++dx) {
+              const int x = std::min((bx * DCTSIZE + u) * sx + dx, max_x);
+              sum += ComponentValue(row + (x - layout.strip_rect.x) * 3, ci,
+                  cinfo->num_components);
+            }
+          }
+          samples[v * DCTSIZE + u] = sum * scale - 128.f;
+        }
+      }
+      EncodeBlock(samples, qtbl, rows[0][bx]);
+    }
+  }
+}
+
+
+/// Copies APPn and COM markers saved by jpeg_save_markers() (as jpegtran does)
+void
+CopyMarkers(j_decompress_ptr src, j_compress_ptr dst)
+{
+  for (jpeg_saved_marker_ptr marker = src->marker_list; marker; marker = marker->next) {
+    // JFIF and Adobe markers are written by the library
+    if (dst->write_JFIF_header && marker->marker == JPEG_APP0
+        && marker->data_length >= 5 && marker->data[0] == 'J'
+        && marker->data[1] == 'F' && marker->data[2] == 'I'
+        && marker->data[3] == 'F' && marker->data[4] == 0) {
+      continue;
+    }
+    if (dst->write_Adobe_marker && marker->marker == JPEG_APP0 + 14
+        && marker->data_length >= 5 && marker->data[0] == 'A'
+        && marker->data[1] == 'd' && marker->data[2] == 'o'
+        && marker->data[3] == 'b' && marker->data[4] == 'e') {
+      continue;
+    }
+    jpeg_write_marker(dst, marker->marker, marker->data, marker->data_length);
+  }
+}
+
+
+/// Transcodes `in` into `out` replacing the coefficients of the MCUs of
+/// `layout.mcu_rects` with the ones encoded from `strip`. No C++ objects are
+/// created after setjmp().
+void
+Transcode(FILE* in, FILE* out, const RegionLayout& layout, const cv::Mat& strip)
+{
+  jpeg_decompress_struct src;
+  jpeg_compress_struct dst;
+  JpegErrorManager jerr;
+  jvirt_barray_ptr* coef;
+
+  // Destroying zeroed structures is a no-op
+  memset(&src, 0, sizeof(src));
+  memset(&dst, 0, sizeof(dst));
+  src.err = &jerr.pub;
+  dst.err = &jerr.pub;
+  InitErrorManager(jerr);
+
+  if (setjmp(jerr.jmp)) {
+    jpeg_destroy_compress(&dst);
+    jpeg_destroy_decompress(&src);
+    throw ErrorException("failed to transcode JPEG: %s", jerr.message);
+  }
+
+  jpeg_create_decompress(&src);
+  jpeg_create_compress(&dst);
+
+  jpeg_stdio_src(&src, in);
+  jpeg_save_markers(&src, JPEG_COM, 0xFFFF);
+  for (int i = 0; i < 16; ++i) {
+    jpeg_save_markers(&src, JPEG_APP0 + i, 0xFFFF);
+  }
+  jpeg_read_header(&src, TRUE);
+  coef = jpeg_read_coefficients(&src);
+
+  // Blocks of overlapping rectangles are encoded to the same coefficients
+  for (int ci = 0; ci < src.num_components; ++ci) {
+    for (size_t i = 0; i < layout.mcu_rects.size(); ++i) {
+      EncodeComponent(&src, coef[ci], ci, layout, layout.mcu_rects[i], strip);
+    }
+  }
+
+  jpeg_copy_critical_parameters(&src, &dst);
+  dst.optimize_coding = TRUE;
+  if (jpeg_has_multiple_scans(&src)) {
+    jpeg_simple_progression(&dst);
+  }
+  jpeg_stdio_dest(&dst, out);
+  jpeg_write_coefficients(&dst, coef);
+  CopyMarkers(&src, &dst);
+
+  jpeg_finish_compress(&dst);
+  jpeg_destroy_compress(&dst);
+  jpeg_finish_decompress(&src);
+  jpeg_destroy_decompress(&src);
+}
+
+} // namespace
+#endif // HAVE_LIBJPEG
+
+/////////////////////////////////////////////////////////////////////
+
+bool
+RewriteJpegRegion(const std::string& input_file, const std::string& output_file,
+    const cv::Rect& rect, int context, const RegionFilter& filter)
+{
+  return RewriteJpegRegions(input_file, output_file, std::vector<cv::Rect>(1, rect),
+      context, filter);
+}
+
+
+bool
+RewriteJpegRegions(const std::string& input_file, const std::string& output_file,
+    const std::vector<cv::Rect>& rects, int context, const RegionFilter& filter)
+{
+#if defined(HAVE_LIBJPEG)
+  FilePtr in(fopen(input_file.c_str(), "rb"));
+  if (!in) {
+    throw ErrorException("failed to open input image " + input_file);
+  }
+
+  unsigned char sig[3];
+  if (fread(sig, 1, sizeof(sig), in.get()) != sizeof(sig)
+      || sig[0] != 0xFF || sig[1] != 0xD8 || sig[2] != 0xFF) {
+    return false;
+  }
+  rewind(in.get());
+
+  RegionLayout layout;
+  cv::Mat decoded;
+  cv::Mat strip;
+  if (!DecodeStrip(in.get(), rects, context, layout, decoded, strip)) {
+    return false;
+  }
+  for (size_t i = 0; i < rects.size(); ++i) {
+    if (layout.rects[i].area() == 0) {
+      throw ErrorException("region %d,%d %dx%d is out of bounds",
+          rects[i].x, rects[i].y, rects[i].width, rects[i].height);
+    }
+  }
+
+  // All of the regions are filtered before the single transcoding pass
+  for (auto& rect : layout.rects) {
+    cv::Mat region(strip(cv::Rect(rect.x - layout.strip_rect.x,
+            rect.y - layout.strip_rect.y, rect.width, rect.height)));
+    filter(region);
+  }
+
+  // The output may be the input file which is read again by Transcode()
+  AtomicFile out(output_file);
+  rewind(in.get());
+  Transcode(in.get(), out.Get(), layout, strip);
+  out.Commit();
+  return true;
+#else
+  (void) input_file;
+  (void) output_file;
+  (void) rects;
+  (void) context;
+  (void) filter;
+  return false;
+#endif
+}
+
+
+bool
+IsJpegFilename(const std::string& filename)
+{
+  auto pos = filename.rfind('.');
+  if (pos == std::string::npos) {
+    return false;
+  }
+
+  std::string ext(filename, pos + 1);
+  std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+  return ext == "jpg" || ext == "jpeg" || ext == "jpe";
+}
+
+// vim: et ts=2 sts=2 sw=2
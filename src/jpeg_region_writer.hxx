@@ -0,0 +1,56 @@
+/* \file
+ *
+ * \copyright Copyright © 2015  Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#pragma once
+#ifndef JPEG_REGION_WRITER_HXX
+#define JPEG_REGION_WRITER_HXX
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+/// Modifies pixels of a region. The argument is the region within a larger
+/// BGR image, so that the pixels around it can be used as well.
+typedef std::function<void(cv::Mat& region)> RegionFilter;
+
+/// Writes JPEG `input_file` with region `rect` modified by `filter` into
+/// `output_file` without re-encoding the rest of the image.
+///
+/// The DCT coefficients of the blocks outside the MCUs touched by `rect` are
+/// copied losslessly. Only the rows covering these MCUs (plus `context`
+/// pixels around them available to the filter) are decoded, and only the
+/// touched MCUs are encoded again using the quantization tables of the input.
+/// The output is written to a temporary file renamed over `output_file` on
+/// success, so `output_file` may be the same as `input_file`.
+/// \returns `false` if the input is not a grayscale or YCbCr JPEG, or has Exif
+/// orientation (the caller should use a full decode/encode). Throws
+/// ErrorException on errors.
+bool RewriteJpegRegion(const std::string& input_file, const std::string& output_file,
+    const cv::Rect& rect, int context, const RegionFilter& filter);
+
+/// The same as RewriteJpegRegion() for several regions written at once.
+/// `filter` is called for each of `rects`.
+bool RewriteJpegRegions(const std::string& input_file, const std::string& output_file,
+    const std::vector<cv::Rect>& rects, int context, const RegionFilter& filter);
+
+/// Whether `filename` has JPEG extension
+bool IsJpegFilename(const std::string& filename);
+
+#endif // JPEG_REGION_WRITER_HXX
+// vim: et ts=2 sts=2 sw=2
@@ -0,0 +1,46 @@
+/* \file
+ *
+ * \copyright Copyright © 2015  Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#pragma once
+#ifndef LOG_HXX
+#define LOG_HXX
+
+#include <cstdio>
+
+/// Verbosity level set by -v options
+extern int g_verbose;
+/// Stream of verbose messages. Switched to stderr when stdout carries results.
+extern FILE* g_verbose_stream;
+
+#define ERROR_LOG(fmt, ...) fprintf(stderr,  fmt  "\n", __VA_ARGS__)
+#define ERROR_LOG0(str) fprintf(stderr,  str  "\n")
+
+#define VERBOSE_LOG(fmt, ...)                           \
+  do {                                                  \
+    if (g_verbose) {                                    \
+      fprintf(g_verbose_stream, fmt "\n", __VA_ARGS__); \
+    }                                                   \
+  } while (0)
+#define VERBOSE_LOG2(fmt, ...)                          \
+  do {                                                  \
+    if (g_verbose > 1) {                                \
+      fprintf(g_verbose_stream, fmt "\n", __VA_ARGS__); \
+    }                                                   \
+  } while (0)
+
+#endif // LOG_HXX
+// vim: et ts=2 sts=2 sw=2
@@ -17,15 +17,22 @@
  */
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
 #include <stdio.h>
+#include <string.h>
 #include <getopt.h>
 #include <unistd.h>
 
-#include <opencv2/highgui/highgui.hpp>
-#include <opencv2/imgproc/imgproc.hpp>
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <iostream>
 
 #include "exceptions.hxx"
 #include "main.hxx"
+#include "sequence.hxx"
+#include "server.hxx"
 
 /////////////////////////////////////////////////////////////////////
 
@@ -45,210 +52,509 @@ FileExists(const char* filename)
 }
 
 
-/// Calculates MSSIM similarity coefficients for each channel
-cv::Scalar
-GetMSSIM(const cv::Mat& i1, const cv::Mat& i2)
+/// Outputs pyramid search counters to stderr
+static void
+PrintPyramidStats()
 {
-  const double C1 = 6.5025, C2 = 58.5225;
-  int d           = CV_32F;
+  const int searches = g_pyramid_stats.searches;
+  const int fallbacks = g_pyramid_stats.fallbacks;
+  const int mismatches = g_pyramid_stats.mismatches;
+  const int checked = searches - fallbacks;
+
+  ERROR_LOG("pyramid search: %d searches, %d fell back to exhaustive search, "
+      "%d of %d (%.2f%%) differ from exhaustive search",
+      searches, fallbacks, mismatches, checked,
+      checked ? 100. * mismatches / checked : 0.);
+}
 
-  cv::Mat I1, I2;
-  i1.convertTo(I1, d); // cannot calculate on one byte large values
-  i2.convertTo(I2, d);
 
-  cv::Mat I2_2  = I2.mul(I2); // I2^2
-  cv::Mat I1_2  = I1.mul(I1); // I1^2
-  cv::Mat I1_I2 = I1.mul(I2); // I1 * I2
+/// Returns sorted paths of regular files in directory `dir`
+static std::vector<std::string>
+ListFiles(const std::string& dir)
+{
+  std::vector<std::string> files;
 
+  DIR* dp = opendir(dir.c_str());
+  if (!dp) {
+    throw ErrorException("failed to open directory " + dir);
+  }
 
-  cv::Mat mu1, mu2;
-  cv::GaussianBlur(I1, mu1, cv::Size(11, 11), 1.5);
-  cv::GaussianBlur(I2, mu2, cv::Size(11, 11), 1.5);
+  while (struct dirent* entry = readdir(dp)) {
+    if (entry->d_name[0] == '.') continue;
 
-  cv::Mat mu1_2   = mu1.mul(mu1);
-  cv::Mat mu2_2   = mu2.mul(mu2);
-  cv::Mat mu1_mu2 = mu1.mul(mu2);
+    std::string path = dir + "/" + entry->d_name;
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+      files.push_back(path);
+    }
+  }
+  closedir(dp);
 
-  cv::Mat sigma1_2, sigma2_2, sigma12;
+  std::sort(files.begin(), files.end());
+  return files;
+}
 
-  cv::GaussianBlur(I1_2, sigma1_2, cv::Size(11, 11), 1.5);
-  sigma1_2 -= mu1_2;
 
-  cv::GaussianBlur(I2_2, sigma2_2, cv::Size(11, 11), 1.5);
-  sigma2_2 -= mu2_2;
+/// Returns RunOptions built from the CLI options
+static RunOptions
+GetDefaultRunOptions()
+{
+  RunOptions opts;
+  opts.roi = g_roi;
+  std::copy(g_blur_margin, g_blur_margin + 4, opts.blur_margin);
+  opts.thresholds = g_thresholds;
+  opts.scales = g_scales;
+  opts.min_match_mssim = g_min_match_mssim;
+  opts.redact.mode = g_redact_mode;
+  opts.redact.kernel_size = g_kernel_size;
+  opts.redact.deviation = g_gaussian_blur_deviation;
+  opts.redact.block_size = g_block_size;
+  opts.dry_run = g_dry_run;
+  opts.jpeg_region_write = g_jpeg_region_write;
+  opts.multi = g_multi;
+  opts.track_radius = g_track_radius;
+  opts.match.pyramid_levels = g_pyramid_levels;
+  opts.match.pyramid_candidates = g_pyramid_candidates;
+  opts.match.pyramid_check = g_pyramid_check;
+  opts.match.pyramid_stats = &g_pyramid_stats;
+  opts.match.accept_mssim = g_accept_mssim;
+  opts.match.max_score = g_multi_score;
+  return opts;
+}
 
-  cv::GaussianBlur(I1_I2, sigma12, cv::Size(11, 11), 1.5);
-  sigma12 -= mu1_mu2;
 
-  cv::Mat t1, t2, t3;
+/// Formats ROIs of `matches` as x,y,width,height separated by semicolons
+static std::string
+FormatRois(const std::vector<MatchResult>& matches)
+{
+  std::string rois;
+  char buf[64];
+  for (auto& match : matches) {
+    snprintf(buf, sizeof(buf), "%s%d,%d,%d,%d", rois.empty() ? "" : ";",
+        match.roi.x, match.roi.y, match.roi.width, match.roi.height);
+    rois += buf;
+  }
+  return rois;
+}
 
-  t1 = 2 * mu1_mu2 + C1;
-  t2 = 2 * sigma12 + C2;
-  t3 = t1.mul(t2);  // t3 = ((2*mu1_mu2 + C1).*(2*sigma12 + C2))
 
-  t1 = mu1_2 + mu2_2 + C1;
-  t2 = sigma1_2 + sigma2_2 + C2;
-  t1 = t1.mul(t2); // t1 =((mu1_2 + mu2_2 + C1).*(sigma1_2 + sigma2_2 + C2))
+/// Records `matches` as the result of `stats`
+static void
+SetStatsResult(RunStats& stats, const std::vector<MatchResult>& matches, const RunOptions& opts)
+{
+  auto& best = matches.front();
+  stats.SetResult(best.mssim, best.threshold, best.roi);
+  if (opts.multi) {
+    for (auto& match : matches) {
+      stats.AddMatch(match.mssim, match.threshold, match.roi);
+    }
+  }
+}
 
-  cv::Mat ssim_map;
-  cv::divide(t3, t1, ssim_map); // ssim_map =  t3./t1;
 
-  cv::Scalar mssim = cv::mean(ssim_map); // mssim = average of ssim map
-  return mssim;
+/// Calls `run` collecting statistics of `opts` if enabled by `--stats`.
+/// The statistics are written to `g_stats_stream` on success and on error.
+static std::vector<MatchResult>
+RunWithStats(const std::string& input_file, const std::string& output_file,
+    RunOptions& opts, const std::function<std::vector<MatchResult>()>& run)
+{
+  if (!g_stats_stream) {
+    return run();
+  }
+
+  RunStats stats(input_file, output_file);
+  opts.stats = &stats;
+  try {
+    auto matches = run();
+    opts.stats = NULL;
+    SetStatsResult(stats, matches, opts);
+    stats.WriteJson(g_stats_stream);
+    return matches;
+  } catch (ErrorException& e) {
+    opts.stats = NULL;
+    stats.SetError(e.what());
+    stats.WriteJson(g_stats_stream);
+    throw;
+  } catch (std::exception& e) {
+    opts.stats = NULL;
+    stats.SetError(e.what());
+    stats.WriteJson(g_stats_stream);
+    throw;
+  }
 }
 
 
-/// Calculates average channel similarity coefficient
-static double
-GetAvgMSSIM(const cv::Mat& i1, const cv::Mat& i2)
+/// Splits comma-separated list of integers into `values`
+/// \returns Number of the parsed values
+static size_t
+ParseIntList(const std::string& str, int* values, size_t max_values, const char* error)
 {
-  auto mssim = GetMSSIM(i1, i2);
-  return (mssim.val[0] + mssim.val[1] + mssim.val[2]) / 3;
+  std::istringstream is(str);
+  std::string item;
+  size_t n{0};
+
+  while (n < max_values && std::getline(is, item, ',')) {
+    values[n++] = GetOptArg<int>(item, "%s '%s'", error, str.c_str());
+  }
+  return n;
 }
 
 
-/// Searches for matching pattern
-/// \param match_loc Match location
-/// \param img Input image
-/// \param tpl The pattern to search for
+/// Parses ROI specified as x,y,width,height (missing values are left intact)
 static void
-MatchTemplate(cv::Point& match_loc, const cv::Mat& img, const cv::Mat& tpl)
+ParseRoi(const std::string& str, cv::Rect& roi)
+{
+  int values[4]{roi.x, roi.y, roi.width, roi.height};
+  ParseIntList(str, values, 4, "Invalid ROI");
+  roi = cv::Rect(values[0], values[1], values[2], values[3]);
+}
+
+
+/// Parses comma-separated list of thresholds
+static std::vector<double>
+ParseThresholds(const std::string& str)
 {
-  cv::Mat result;
-  int match_method = CV_TM_SQDIFF;
-
-  int result_cols = img.cols - tpl.cols + 1;
-  int result_rows = img.rows - tpl.rows + 1;
-  result.create(result_cols, result_rows, CV_32FC1);
-
-  cv::matchTemplate(img, tpl, result, match_method);
-  cv::normalize(result, result, 0, 1, cv::NORM_MINMAX, -1, cv::Mat());
-
-  // Find the best match with minMaxLoc
-  double min_val, max_val;
-  cv::Point min_loc, max_loc;
-  cv::minMaxLoc(result, &min_val, &max_val, &min_loc, &max_loc, cv::Mat());
-
-  // For SQDIFF and SQDIFF_NORMED, the best matches are lower values. For all
-  // the other methods, the higher the better
-  if( match_method  == CV_TM_SQDIFF || match_method == CV_TM_SQDIFF_NORMED ) {
-    match_loc = min_loc;
-  } else {
-    match_loc = max_loc;
+  std::vector<double> thresholds;
+  std::istringstream is(str);
+  std::string item;
+
+  while (std::getline(is, item, ',')) {
+    thresholds.push_back(GetOptArg<double>(item, "Invalid threshold value '%s'", item.c_str()));
   }
+  return thresholds;
 }
 
 
-static void
-Run()
+/// Parses scale range specified as min:max:step (max is included) or a single
+/// scale
+static std::vector<double>
+ParseScales(const std::string& str)
 {
-  cv::Point match_loc;
-  cv::Mat in_img;
-  cv::Mat in_img_inverted;
-  cv::Rect roi_nearest;
-  cv::Mat out_img;
-  double max_mssim{0.};
-
-  // Read input image forcing 3 channels
-  in_img = cv::imread(g_input_file, 1);
-  if (in_img.empty()) {
-    throw ErrorException("failed to read input image " + g_input_file);
+  double values[3]{0., 0., 1.};
+  std::istringstream is(str);
+  std::string item;
+  size_t n{0};
+
+  while (n < 3 && std::getline(is, item, ':')) {
+    values[n++] = GetOptArg<double>(item, "Invalid scales '%s'", str.c_str());
+  }
+  if (n == 1) {
+    values[1] = values[0];
+  }
+  if (n == 2 || values[0] <= 0 || values[1] < values[0] || values[2] <= 0) {
+    throw InvalidCliArgException("Invalid scales '%s'", str.c_str());
   }
 
-  out_img = in_img.clone();
+  std::vector<double> scales;
+  // The tolerance keeps `max` despite the rounding errors of the step
+  const int num_scales = static_cast<int>((values[1] - values[0]) / values[2] + 1e-9) + 1;
+  if (num_scales > g_kMaxScales) {
+    throw InvalidCliArgException("Too many scales '%s'", str.c_str());
+  }
+  for (int i = 0; i < num_scales; ++i) {
+    scales.push_back(values[0] + i * values[2]);
+  }
+  return scales;
+}
+
+
+/// Processes a server request. The parameters are documented in the usage
+/// message.
+static void
+HandleServerRequest(const ServerRequest& request, ServerResponse& response)
+{
+  auto opts = GetDefaultRunOptions();
+  std::string input_file;
+  std::string output_file;
+  std::string output_format;
+
+  for (auto& param : request.params) {
+    auto& key = param.first;
+    auto& value = param.second;
+
+    if (key == "input") {
+      input_file = value;
+    } else if (key == "input-size") {
+      // Handled by Serve()
+    } else if (key == "output") {
+      output_file = value;
+    } else if (key == "output-format") {
+      output_format = value;
+      if (!output_format.empty() && output_format[0] != '.') {
+        output_format.insert(0, ".");
+      }
+    } else if (key == "roi") {
+      ParseRoi(value, opts.roi);
+      if (opts.roi.width <= 0) opts.roi.width = 1e6;
+      if (opts.roi.height <= 0) opts.roi.height = 1e6;
+    } else if (key == "margin") {
+      ParseIntList(value, opts.blur_margin, 4, "Invalid blur margin");
+    } else if (key == "threshold") {
+      opts.thresholds = ParseThresholds(value);
+    } else if (key == "min-mssim") {
+      opts.min_match_mssim = GetOptArg<double>(value, "Invalid min. MSSIM value");
+      if (opts.min_match_mssim < 0 || opts.min_match_mssim > 1) {
+        throw ErrorException("min. MSSIM value is out of range [0.0 .. 1.0]");
+      }
+    } else if (key == "accept-mssim") {
+      opts.match.accept_mssim = GetOptArg<double>(value, "Invalid accept MSSIM value");
+      if (opts.match.accept_mssim < 0 || opts.match.accept_mssim > 1) {
+        throw ErrorException("accept MSSIM value is out of range [0.0 .. 1.0]");
+      }
+    } else if (key == "kernel-size") {
+      opts.redact.kernel_size = GetOptArg<int>(value, "Invalid kernel size");
+    } else if (key == "deviation") {
+      opts.redact.deviation = GetOptArg<int>(value, "Invalid Gaussian blur deviation");
+    } else if (key == "redact") {
+      if (!ParseRedactMode(value, opts.redact.mode)) {
+        throw ErrorException("unknown redaction mode %s", value.c_str());
+      }
+    } else if (key == "block-size") {
+      opts.redact.block_size = GetOptArg<int>(value, "Invalid block size");
+      if (opts.redact.block_size < 1) {
+        throw ErrorException("block size must be positive");
+      }
+    } else if (key == "scales") {
+      opts.scales = ParseScales(value);
+    } else if (key == "multi") {
+      opts.multi = GetOptArg<int>(value, "Invalid multi value") != 0;
+    } else if (key == "multi-score") {
+      opts.match.max_score = GetOptArg<double>(value, "Invalid multi score");
+      if (opts.match.max_score < 0 || opts.match.max_score > 1) {
+        throw ErrorException("multi score is out of range [0.0 .. 1.0]");
+      }
+    } else if (key == "dry-run") {
+      opts.dry_run = GetOptArg<int>(value, "Invalid dry-run value") != 0;
+    } else {
+      throw ErrorException("unknown request parameter %s", key.c_str());
+    }
+  }
 
-  // Convert input image to grayscale
-  if (in_img.channels() > 1) {
-    cv::cvtColor(in_img, in_img, CV_BGR2GRAY);
+  if (request.input.empty() == input_file.empty()) {
+    throw ErrorException("either input or input-size expected");
+  }
+  if (!opts.dry_run && output_file.empty() == output_format.empty()) {
+    throw ErrorException("either output or output-format expected");
+  }
+  if (opts.thresholds.empty()) {
+    throw ErrorException("threshold expected");
   }
 
-  // Create inverted version of input image
-  cv::bitwise_not(in_img, in_img_inverted);
+  auto process = [&]() -> std::vector<MatchResult> {
+    if (!input_file.empty() && (opts.dry_run || !output_file.empty())) {
+      return g_matcher->ProcessFile(input_file, output_file, opts);
+    }
 
-  // Suppress noise
-  cv::threshold(in_img, in_img, g_threshold, g_kThresholdColor, CV_THRESH_BINARY);
-  cv::threshold(in_img_inverted, in_img_inverted, g_threshold, g_kThresholdColor, CV_THRESH_BINARY);
+    cv::Mat img;
+    if (input_file.empty()) {
+      img = DecodeImage(request.input.data(), request.input.size(), opts.stats);
+    } else {
+      StageTimer timer(opts.stats, RunStats::kDecode);
+      img = ReadImage(input_file);
+      timer.Add(img);
+    }
 
-  // Process mask files
-  for (auto& mask_file : g_mask_files) {
-    cv::Mat tpl_img(cv::imread(mask_file, 1));
-    if (tpl_img.empty()) {
-      ERROR_LOG("skipping empty/invalid mask image %sn", mask_file.c_str());
+    const Redactor redactor;
+    auto matches = g_matcher->Find(img, opts);
+    if (opts.dry_run) {
+      return matches;
     }
-    // Convert mask to grayscale
-    if (tpl_img.channels() > 1) {
-      cv::cvtColor(tpl_img, tpl_img, CV_BGR2GRAY);
+
+    if (!output_file.empty()) {
+      redactor.Write(input_file, output_file, img, matches, opts);
+    } else {
+      redactor.Redact(img, matches, opts);
+      redactor.Encode(img, output_format, response.output, opts);
     }
+    return matches;
+  };
+  auto matches = RunWithStats(input_file,
+      output_file.empty() ? output_format : output_file, opts, process);
+  auto& result = matches.front();
+
+  char buf[128];
+  response.params.emplace_back("status", "ok");
+  snprintf(buf, sizeof(buf), "%f", result.mssim);
+  response.params.emplace_back("mssim", buf);
+  snprintf(buf, sizeof(buf), "%f", result.threshold);
+  response.params.emplace_back("threshold", buf);
+  response.params.emplace_back("roi", FormatRois(matches));
+  if (!output_file.empty()) {
+    response.params.emplace_back("output", output_file);
+  }
+}
 
-    // Create inverted version of the mask
-    cv::Mat tpl_img_inverted;
-    cv::bitwise_not(tpl_img, tpl_img_inverted);
 
-    for (auto& img : {in_img, in_img_inverted}) {
-      cv::Rect img_rect(0, 0, img.cols, img.rows);
+/// Opens list of input/output pairs `list_file` ("-" means stdin)
+/// \param stream Stream opened for a regular file
+static std::istream&
+OpenFileList(const std::string& list_file, std::ifstream& stream)
+{
+  if (list_file == "-") {
+    return std::cin;
+  }
 
-      cv::Rect tmp_roi(g_roi);
-      if (tmp_roi.x < 0) tmp_roi.x = img_rect.width + tmp_roi.x;
-      if (tmp_roi.y < 0) tmp_roi.y = img_rect.height + tmp_roi.y;
+  stream.open(list_file);
+  if (!stream) {
+    throw ErrorException("failed to open file list " + list_file);
+  }
+  return stream;
+}
 
-      cv::Rect in_img_roi(tmp_roi & img_rect);
-      if (in_img_roi.area() == 0) {
-        ERROR_LOG("ROI %d,%d %dx%d is out of bounds, skipping",
-            tmp_roi.x, tmp_roi.y, tmp_roi.width, tmp_roi.height);
-        continue;
-      }
-      VERBOSE_LOG2("using ROI %d,%d %dx%d",
-          in_img_roi.x, in_img_roi.y, in_img_roi.width, in_img_roi.height);
 
-      for (auto& tpl : {tpl_img, tpl_img_inverted}) {
-        // Find best matching location for current mask
-        MatchTemplate(match_loc, img(in_img_roi), tpl);
+/// Reads the next input/output pair separated by tab or comma from `is`.
+/// Empty lines and comments are skipped; invalid lines are reported and
+/// counted in `num_invalid`.
+/// \returns `false` at the end of the list
+static bool
+ReadFilePair(std::istream& is, std::string& input_file, std::string& output_file,
+    int& num_invalid)
+{
+  std::string line;
+  while (std::getline(is, line)) {
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    if (line.empty() || line[0] == '#') continue;
+
+    auto pos = line.find('\t');
+    if (pos == std::string::npos) pos = line.find(',');
+    if (pos == std::string::npos) {
+      ERROR_LOG("skipping invalid batch line: %s", line.c_str());
+      ++num_invalid;
+      continue;
+    }
+    input_file.assign(line, 0, pos);
+    output_file.assign(line, pos + 1, std::string::npos);
+    return true;
+  }
+  return false;
+}
+
+
+/// Prints batch result line of a successfully processed pair
+static void
+PrintResult(const std::string& input_file, const std::string& output_file,
+    const std::vector<MatchResult>& matches)
+{
+  auto& result = matches.front();
+  printf("ok\t%s\t%s\t%f\t%s\t%f\n",
+      input_file.c_str(), output_file.c_str(), result.mssim,
+      FormatRois(matches).c_str(), result.threshold);
+  fflush(stdout);
+}
 
-        // Calculate similarity coefficient
-        cv::Rect roi(match_loc.x + in_img_roi.x,
-            match_loc.y + in_img_roi.y,
-            tpl.cols, tpl.rows);
 
-        auto mssim = GetAvgMSSIM(tpl, img(roi));
+/// Prints batch result line of a failed pair
+static void
+PrintFailure(const std::string& input_file, const std::string& output_file,
+    const char* message)
+{
+  printf("fail\t%s\t%s\t%s\n", input_file.c_str(), output_file.c_str(), message);
+  fflush(stdout);
+}
 
-        VERBOSE_LOG2("ROI: (%d, %d) %dx%d", roi.x, roi.y, roi.width, roi.height);
-        VERBOSE_LOG2("MSSIM for %s: %f", mask_file.c_str(), mssim);
 
-        if (mssim > max_mssim) {
-          max_mssim = mssim;
-          roi_nearest = roi;
-        }
-      }
+/// Runs Matcher::ProcessFile() for each input/output pair listed in `g_batch_file`
+/// \returns Number of failed pairs
+static int
+RunBatch()
+{
+  std::ifstream batch_stream;
+  std::istream& is = OpenFileList(g_batch_file, batch_stream);
+
+  auto opts = GetDefaultRunOptions();
+  int num_failed{0};
+  std::string input_file;
+  std::string output_file;
+  while (ReadFilePair(is, input_file, output_file, num_failed)) {
+    try {
+      auto matches = RunWithStats(input_file, output_file, opts,
+          [&] { return g_matcher->ProcessFile(input_file, output_file, opts); });
+      PrintResult(input_file, output_file, matches);
+    } catch (ErrorException& e) {
+      PrintFailure(input_file, output_file, e.what());
+      ++num_failed;
+    } catch (std::exception& e) {
+      PrintFailure(input_file, output_file, e.what());
+      ++num_failed;
     }
   }
 
-  if (max_mssim <= g_min_match_mssim) {
-    throw ErrorException("Unable to find a good matching pattern");
-  }
+  return num_failed;
+}
 
-  roi_nearest.x      -= g_blur_margin[3];
-  roi_nearest.y      -= g_blur_margin[0];
-  roi_nearest.width  += g_blur_margin[1] + g_blur_margin[3];
-  roi_nearest.height += g_blur_margin[2] + g_blur_margin[0];
-  cv::Mat roi_img_nearest(out_img(roi_nearest));
-
-  cv::GaussianBlur(roi_img_nearest, roi_img_nearest,
-      cv::Size(g_kernel_size, g_kernel_size),
-      g_gaussian_blur_deviation);
-#if defined(DEBUG)
-  cv::rectangle(roi_img_nearest, cv::Point(0,0),
-      cv::Point(roi_img_nearest.cols, roi_img_nearest.rows),
-      cv::Scalar(0,200,200), -1, 8);
-#endif
-
-  VERBOSE_LOG("writing to file %s using MSSIM %f roi %d,%d,%d,%d",
-      g_output_file.c_str(), max_mssim,
-      roi_nearest.x, roi_nearest.y, roi_nearest.width, roi_nearest.height);
-  if (!g_dry_run) {
-    if (!cv::imwrite(g_output_file, out_img)) {
-      throw ErrorException("failed to save to file " + g_output_file);
+
+/// Processes input/output pairs listed in `g_sequence_file` as frames of a
+/// sequence tracking the match from frame to frame. Decoding, matching and
+/// encoding of different frames run concurrently.
+/// \returns Number of failed frames
+static int
+RunSequence()
+{
+  std::ifstream sequence_stream;
+  std::istream& is = OpenFileList(g_sequence_file, sequence_stream);
+
+  const auto opts = GetDefaultRunOptions();
+  int num_failed{0};
+  int num_invalid{0};
+  // Tracking applies to the single best match
+  const bool tracking = !opts.multi;
+  MatchResult previous;
+  bool have_previous{false};
+
+  auto read = [&](Frame& frame) -> bool {
+    if (!ReadFilePair(is, frame.input_file, frame.output_file, num_invalid)) {
+      return false;
     }
-  }
+    if (g_stats_stream) {
+      frame.stats.reset(new RunStats(frame.input_file, frame.output_file));
+    }
+
+    StageTimer timer(frame.stats.get(), RunStats::kDecode);
+    frame.img = ReadImage(frame.input_file);
+    timer.Add(frame.img);
+    return true;
+  };
+
+  auto process = [&](Frame& frame) {
+    RunOptions frame_opts(opts);
+    frame_opts.stats = frame.stats.get();
+
+    const bool track = tracking && have_previous;
+    have_previous = false;
+    frame.matches = g_matcher->Track(frame.img, frame_opts, track ? &previous : NULL);
+    previous = frame.matches.front();
+    have_previous = true;
+  };
+
+  auto write = [&](Frame& frame) {
+    if (opts.dry_run) {
+      return;
+    }
+    RunOptions frame_opts(opts);
+    frame_opts.stats = frame.stats.get();
+    Redactor().Write(frame.input_file, frame.output_file, frame.img, frame.matches, frame_opts);
+  };
+
+  auto report = [&](Frame& frame) {
+    if (frame.error.empty()) {
+      PrintResult(frame.input_file, frame.output_file, frame.matches);
+    } else {
+      PrintFailure(frame.input_file, frame.output_file, frame.error.c_str());
+      ++num_failed;
+    }
+
+    if (frame.stats) {
+      if (frame.error.empty()) {
+        SetStatsResult(*frame.stats, frame.matches, opts);
+      } else {
+        frame.stats->SetError(frame.error);
+      }
+      frame.stats->WriteJson(g_stats_stream);
+    }
+  };
+
+  RunSequence(read, process, write, report, g_kSequenceQueueSize);
+  return num_failed + num_invalid;
 }
 
 /////////////////////////////////////////////////////////////////////
@@ -292,38 +598,53 @@ main(int argc, char **argv)
           g_threshold = optarg ? GetOptArg<int>(optarg, "Invalid threshold value") : 0;
           break;
 
-        case 'r':
+        case g_kOptThresholdSweep:
           {
-            if (!optarg) break;
-
-            const char* delim = ",";
-            char* pch;
-            if ((pch = strtok(optarg, delim)) == NULL) break;
-            g_roi.x = std::stoi(std::string(pch));
-            if ((pch = strtok(NULL, delim)) == NULL) break;
-            g_roi.y = std::stoi(std::string(pch));
-            if ((pch = strtok(NULL, delim)) == NULL) break;
-            g_roi.width = std::stoi(std::string(pch));
-            if ((pch = strtok(NULL, delim)) == NULL) break;
-            g_roi.height = std::stoi(std::string(pch));
+            auto thresholds = ParseThresholds(optarg);
+            g_thresholds.insert(g_thresholds.end(), thresholds.begin(), thresholds.end());
           }
           break;
 
-        case 'm':
-          {
-            if (!optarg) break;
-
-            const char* delim = ",";
-            char* pch;
-            if ((pch = strtok(optarg, delim)) == NULL) break;
-            g_blur_margin[0] = std::stoi(std::string(pch));
-            if ((pch = strtok(NULL, delim)) == NULL) break;
-            g_blur_margin[1] = std::stoi(std::string(pch));
-            if ((pch = strtok(NULL, delim)) == NULL) break;
-            g_blur_margin[2] = std::stoi(std::string(pch));
-            if ((pch = strtok(NULL, delim)) == NULL) break;
-            g_blur_margin[3] = std::stoi(std::string(pch));
+        case g_kOptScales:
+          g_scales = ParseScales(optarg);
+          break;
+
+        case g_kOptPyramidLevels:
+          g_pyramid_levels = GetOptArg<int>(optarg, "Invalid number of pyramid levels");
+          break;
+
+        case g_kOptPyramidCandidates:
+          g_pyramid_candidates = GetOptArg<int>(optarg, "Invalid number of pyramid candidates");
+          break;
+
+        case g_kOptPyramidCheck:
+          g_pyramid_check = true;
+          break;
+
+        case g_kOptJpegRegionWrite:
+          g_jpeg_region_write = true;
+          break;
+
+        case g_kOptCompileMasks:
+          if (!FileExists(optarg)) {
+            throw InvalidCliArgException("Directory '%s' doesn't exist", optarg);
           }
+          g_compile_masks_dir = optarg;
+          break;
+
+        case g_kOptMaskLibrary:
+          if (!FileExists(optarg)) {
+            throw InvalidCliArgException("File '%s' doesn't exist", optarg);
+          }
+          g_mask_library_file = optarg;
+          break;
+
+        case 'r':
+          if (optarg) ParseRoi(optarg, g_roi);
+          break;
+
+        case 'm':
+          if (optarg) ParseIntList(optarg, g_blur_margin, 4, "Invalid blur margin");
           break;
 
         case 's':
@@ -334,6 +655,77 @@ main(int argc, char **argv)
           g_dry_run = true;
           break;
 
+        case 'b':
+          if (strcmp(optarg, "-") && !FileExists(optarg)) {
+            throw InvalidCliArgException("File '%s' doesn't exist", optarg);
+          }
+          g_batch_file = optarg;
+          break;
+
+        case 'j':
+          g_num_threads = GetOptArg<int>(optarg, "Invalid number of jobs");
+          break;
+
+        case g_kOptAcceptMssim:
+          g_accept_mssim = GetOptArg<double>(optarg, "Invalid accept MSSIM value");
+          break;
+
+        case g_kOptMaskHistory:
+          g_mask_history_file = optarg;
+          break;
+
+        case g_kOptMulti:
+          g_multi = true;
+          break;
+
+        case g_kOptMultiScore:
+          g_multi_score = GetOptArg<double>(optarg, "Invalid multi score");
+          break;
+
+        case g_kOptRedact:
+          if (!ParseRedactMode(optarg, g_redact_mode)) {
+            throw InvalidCliArgException("Unknown redaction mode '%s'", optarg);
+          }
+          break;
+
+        case g_kOptBlockSize:
+          g_block_size = GetOptArg<int>(optarg, "Invalid block size");
+          break;
+
+        case g_kOptStats:
+          if (strcmp(optarg, "json")) {
+            throw InvalidCliArgException("Unsupported stats format '%s'", optarg);
+          }
+          g_stats_format = optarg;
+          break;
+
+        case g_kOptStatsFile:
+          g_stats_file = optarg;
+          break;
+
+        case g_kOptSequence:
+          if (strcmp(optarg, "-") && !FileExists(optarg)) {
+            throw InvalidCliArgException("File '%s' doesn't exist", optarg);
+          }
+          g_sequence_file = optarg;
+          break;
+
+        case g_kOptTrackRadius:
+          g_track_radius = GetOptArg<int>(optarg, "Invalid tracking radius");
+          break;
+
+        case g_kOptServe:
+          g_serve_path = optarg;
+          break;
+
+        case g_kOptServeWorkers:
+          g_serve_workers = GetOptArg<int>(optarg, "Invalid number of server workers");
+          break;
+
+        case g_kOptServeQueue:
+          g_serve_queue_size = GetOptArg<int>(optarg, "Invalid server queue size");
+          break;
+
         case 'v':
           g_verbose++;
           break;
@@ -358,7 +750,7 @@ main(int argc, char **argv)
     ::exit(EXIT_FAILURE);
   }
 
-  if (optind >= argc) {
+  if (optind >= argc && g_compile_masks_dir.empty() && g_mask_library_file.empty()) {
     ERROR_LOG0("Mask image(s) expected");
     Usage(true);
     ::exit(EXIT_FAILURE);
@@ -366,18 +758,53 @@ main(int argc, char **argv)
 
   bool error{true};
   do {
-    if (g_output_file.empty()) {
-      ERROR_LOG0("output file expected");
+    if (!g_compile_masks_dir.empty()) {
+      if (g_output_file.empty()) {
+        ERROR_LOG0("output file expected");
+        break;
+      }
+    } else if (g_batch_file.empty() && g_sequence_file.empty() && g_serve_path.empty()) {
+      if (g_output_file.empty()) {
+        ERROR_LOG0("output file expected");
+        break;
+      }
+      if (g_input_file.empty()) {
+        ERROR_LOG0("input file expected");
+        break;
+      }
+    }
+    if (g_num_threads < 1) {
+      ERROR_LOG0("number of jobs must be positive");
+      break;
+    }
+    if (g_track_radius < 0) {
+      ERROR_LOG0("tracking radius must not be negative");
       break;
     }
-    if (g_input_file.empty()) {
-      ERROR_LOG0("input file expected");
+    if (g_block_size < 1) {
+      ERROR_LOG0("block size must be positive");
+      break;
+    }
+    if (g_serve_workers < 1 || g_serve_queue_size < 1) {
+      ERROR_LOG0("invalid server parameters");
+      break;
+    }
+    if (g_pyramid_levels < 0 || g_pyramid_candidates < 1) {
+      ERROR_LOG0("invalid pyramid search parameters");
       break;
     }
     if (g_min_match_mssim < 0 || g_min_match_mssim > 1) {
       ERROR_LOG0("min. MSSIM value is out of range [0.0 .. 1.0]");
       break;
     }
+    if (g_accept_mssim < 0 || g_accept_mssim > 1) {
+      ERROR_LOG0("accept MSSIM value is out of range [0.0 .. 1.0]");
+      break;
+    }
+    if (g_multi_score < 0 || g_multi_score > 1) {
+      ERROR_LOG0("multi score is out of range [0.0 .. 1.0]");
+      break;
+    }
 
     error = false;
   } while (0);
@@ -386,45 +813,117 @@ main(int argc, char **argv)
     ::exit(EXIT_FAILURE);
   }
 
+  // Batch and sequence modes print result lines to stdout
+  if (!g_batch_file.empty() || !g_sequence_file.empty()) {
+    g_verbose_stream = stderr;
+  }
+
+  if (g_thresholds.empty()) g_thresholds.push_back(g_threshold);
   if (g_roi.width <= 0) g_roi.width = 1e6;
   if (g_roi.height <= 0) g_roi.height = 1e6;
 
+  VERBOSE_LOG("mask library: %s", g_mask_library_file.c_str());
+  VERBOSE_LOG("batch file: %s", g_batch_file.c_str());
+  VERBOSE_LOG("sequence file: %s tracking radius: %d", g_sequence_file.c_str(), g_track_radius);
+  VERBOSE_LOG("server socket: %s", g_serve_path.c_str());
   VERBOSE_LOG("input file: %s", g_input_file.c_str());
   VERBOSE_LOG("output file: %s", g_output_file.c_str());
-  VERBOSE_LOG("threshold: %f", g_threshold);
+  for (auto threshold : g_thresholds) {
+    VERBOSE_LOG("threshold: %f", threshold);
+  }
+  for (auto scale : g_scales) {
+    VERBOSE_LOG("scale: %f", scale);
+  }
   VERBOSE_LOG("blur kernel size: %d", g_kernel_size);
   VERBOSE_LOG("blur deviation: %d", g_gaussian_blur_deviation);
+  VERBOSE_LOG("redaction mode: %d block size: %d", static_cast<int>(g_redact_mode), g_block_size);
   VERBOSE_LOG("roi: (%d,%d) %dx%d", g_roi.x, g_roi.y, g_roi.width, g_roi.height);
   VERBOSE_LOG("blur margin: %d %d %d %d", g_blur_margin[0], g_blur_margin[1], g_blur_margin[2], g_blur_margin[3]);
   VERBOSE_LOG("min. MSSIM: %f", g_min_match_mssim);
+  VERBOSE_LOG("accept MSSIM: %f", g_accept_mssim);
+  VERBOSE_LOG("mask history: %s", g_mask_history_file.c_str());
+  VERBOSE_LOG("multi: %d score: %f", static_cast<int>(g_multi), g_multi_score);
   VERBOSE_LOG("dry run: %d", static_cast<int>(g_dry_run));
+  VERBOSE_LOG("JPEG region write: %d", static_cast<int>(g_jpeg_region_write));
+  VERBOSE_LOG("jobs: %d", g_num_threads);
+  VERBOSE_LOG("stats: %s %s", g_stats_format.c_str(), g_stats_file.c_str());
+  VERBOSE_LOG("pyramid levels: %d candidates: %d", g_pyramid_levels, g_pyramid_candidates);
+
+  g_thread_pool.reset(new ThreadPool(g_num_threads));
+
+  if (!g_stats_format.empty()) {
+    g_stats_stream = g_stats_file.empty() ? stderr : fopen(g_stats_file.c_str(), "a");
+    if (!g_stats_stream) {
+      ERROR_LOG("failed to open stats file %s: %s", g_stats_file.c_str(), strerror(errno));
+      ::exit(EXIT_FAILURE);
+    }
+  }
 
+  int status{EXIT_SUCCESS};
   try {
     while (optind < argc) {
       const char* filename{argv[optind++]};
       if (!filename) continue;
       if (!FileExists(filename)) {
-        throw InvalidCliArgException("File '%s' doesn't exist", optarg);
+        throw InvalidCliArgException("File '%s' doesn't exist", filename);
       }
 
       g_mask_files.push_back(std::string(filename));
     }
-    if (g_mask_files.empty()) {
+    if (!g_compile_masks_dir.empty()) {
+      auto dir_files = ListFiles(g_compile_masks_dir);
+      g_mask_files.insert(g_mask_files.end(), dir_files.begin(), dir_files.end());
+    }
+    if (g_mask_files.empty() && g_mask_library_file.empty()) {
       ERROR_LOG0("No valid mask files provided");
       Usage(true);
       ::exit(EXIT_FAILURE);
     }
 
-    Run();
+    if (!g_mask_history_file.empty() && g_compile_masks_dir.empty()) {
+      g_mask_history.reset(new MaskHistory(g_mask_history_file));
+    }
+    g_mask_set = std::make_shared<const MaskSet>(g_mask_files, g_mask_library_file,
+        g_mask_history.get());
+    g_matcher.reset(new Matcher(g_mask_set, *g_thread_pool, g_mask_history.get()));
+
+    if (!g_compile_masks_dir.empty()) {
+      VERBOSE_LOG("writing %zu mask(s) to library %s",
+          g_mask_set->Masks().size(), g_output_file.c_str());
+      MaskLibrary::Write(g_output_file, g_mask_set->Masks());
+    } else if (!g_serve_path.empty()) {
+      VERBOSE_LOG("serving on %s with %d worker(s)", g_serve_path.c_str(), g_serve_workers);
+      Serve(g_serve_path, g_serve_workers, g_serve_queue_size, HandleServerRequest);
+    } else if (!g_batch_file.empty()) {
+      if (RunBatch() > 0) {
+        status = EXIT_FAILURE;
+      }
+    } else if (!g_sequence_file.empty()) {
+      if (RunSequence() > 0) {
+        status = EXIT_FAILURE;
+      }
+    } else {
+      auto opts = GetDefaultRunOptions();
+      RunWithStats(g_input_file, g_output_file, opts,
+          [&] { return g_matcher->ProcessFile(g_input_file, g_output_file, opts); });
+    }
+
+    if (g_mask_history) {
+      g_mask_history->Save();
+    }
   } catch (ErrorException& e) {
     ERROR_LOG("Fatal error: %s", e.what());
-    ::exit(EXIT_FAILURE);
+    status = EXIT_FAILURE;
   } catch (std::exception& e) {
     ERROR_LOG("Uncaugth exception: %s", e.what());
-    ::exit(EXIT_FAILURE);
+    status = EXIT_FAILURE;
+  }
+
+  if (g_pyramid_check) {
+    PrintPyramidStats();
   }
 
-  exit(EXIT_SUCCESS);
+  exit(status);
 }
 
 // vim: et ts=2 sts=2 sw=2
@@ -19,40 +19,22 @@
 #ifndef MAIN_HXX
 #define MAIN_HXX
 
-#include <cstdarg>
+#include <atomic>
+#include <memory>
 #include <sstream>
 #include <string>
 #include <vector>
 
 #include <opencv2/core/core.hpp>
 
+#include "blurpat.hxx"
 #include "exceptions.hxx"
+#include "log.hxx"
+#include "options.hxx"
 
 /////////////////////////////////////////////////////////////////////
 
-#define ERROR_LOG(fmt, ...) fprintf(stderr,  fmt  "\n", __VA_ARGS__)
-#define ERROR_LOG0(str) fprintf(stderr,  str  "\n")
-
-#define VERBOSE_LOG(fmt, ...)        \
-  do {                               \
-    if (g_verbose) {                 \
-      printf(fmt "\n", __VA_ARGS__); \
-    }                                \
-  } while (0)
-#define VERBOSE_LOG2(fmt, ...)       \
-  do {                               \
-    if (g_verbose > 1) {             \
-      printf(fmt "\n", __VA_ARGS__); \
-    }                                \
-  } while (0)
-
-/////////////////////////////////////////////////////////////////////
-
-int g_verbose{0};
-
 const char* g_kProgramName;
-/// Color used by cv::threshold()
-const int g_kThresholdColor{255};
 
 /////////////////////////////////////////////////////////////////////
 // CLI options
@@ -60,15 +42,80 @@ const int g_kThresholdColor{255};
 std::vector<std::string> g_mask_files;
 std::string g_input_file;
 std::string g_output_file;
+/// File with input/output pairs for batch processing ("-" for stdin)
+std::string g_batch_file;
+/// File with input/output pairs of sequence frames ("-" for stdin)
+std::string g_sequence_file;
+/// Distance in pixels from the previous match searched on the next frame
+int g_track_radius{32};
+/// Directory with mask images to compile into a mask library
+std::string g_compile_masks_dir;
+/// Precompiled mask library file
+std::string g_mask_library_file;
 double g_threshold{80.};
+/// Candidate thresholds for --threshold-sweep
+std::vector<double> g_thresholds;
+/// Sizes of the masks relative to their own size tried by --scales (only the
+/// original size if empty)
+std::vector<double> g_scales;
 int g_kernel_size{3};
 int g_gaussian_blur_deviation{10};
+/// How the matched region is obscured
+RedactMode g_redact_mode{RedactMode::kGaussian};
+/// Block size of the pixelation
+int g_block_size{16};
 cv::Rect g_roi;
 int g_blur_margin[4]{0,0,0,0};
 /// Minimum MSSIM (similarity) coefficient for a pattern match to be
 /// considered "good enough"
 double g_min_match_mssim{0.1};
+/// MSSIM at which the search stops without trying the remaining masks
+/// (0 means the best match is searched for)
+double g_accept_mssim{0.};
+/// File with numbers of matches of the masks used to order them
+std::string g_mask_history_file;
+/// Whether to redact all occurrences of the masks instead of the best match
+bool g_multi{false};
+/// Maximum normalized SQDIFF score of the locations verified in --multi mode
+double g_multi_score{0.25};
 bool g_dry_run{false};
+/// Whether to re-encode only the blurred MCUs of JPEG images
+bool g_jpeg_region_write{false};
+/// Number of threads used for matching
+int g_num_threads{1};
+/// Unix domain socket path for the server mode
+std::string g_serve_path;
+/// Number of connections handled concurrently in the server mode
+int g_serve_workers{4};
+/// Maximum number of accepted connections waiting for a worker
+int g_serve_queue_size{64};
+/// Format of the per-image statistics ("json" or empty if disabled)
+std::string g_stats_format;
+/// File the statistics are appended to (stderr by default)
+std::string g_stats_file;
+/// Stream the statistics are written to if enabled
+FILE* g_stats_stream{NULL};
+
+/// Number of pyramid levels used by MatchTemplate(). 0 means exhaustive search.
+int g_pyramid_levels{0};
+/// Number of best coarse level locations refined on finer levels
+int g_pyramid_candidates{4};
+/// Whether to compare pyramid search results with exhaustive search
+bool g_pyramid_check{false};
+/// Counters of the pyramid search
+PyramidStats g_pyramid_stats;
+
+/// Pool running the matching jobs
+std::unique_ptr<ThreadPool> g_thread_pool;
+
+/////////////////////////////////////////////////////////////////////
+
+/// Masks loaded from `g_mask_library_file` and `g_mask_files`
+std::shared_ptr<const MaskSet> g_mask_set;
+/// Hit counts of the masks updated by each match
+std::unique_ptr<MaskHistory> g_mask_history;
+/// Matcher of `g_mask_set` running the jobs on `g_thread_pool`
+std::unique_ptr<Matcher> g_matcher;
 
 /////////////////////////////////////////////////////////////////////
 /// Template for `printf`-like function.
@@ -82,21 +129,115 @@ const char* g_kUsageTemplate{
 " -o, --output             Path to output image.\n"
 " -d, --blur-deviation     Gaussian blur deviation. Default: 10\n"
 " -k, --blur-kernel-size   Gaussian blur kernel size. Default: 3\n"
+"     --redact             How to obscure the match: gaussian, box (running-sum\n"
+"                          box blur approximating the Gaussian within the same\n"
+"                          radius; the cost doesn't depend on the radius),\n"
+"                          pixelate or fill (black). Default: gaussian\n"
+"     --block-size         Block size for --redact=pixelate. Default: 16\n"
 " -t, --threshold          Noise suppression threshold (0..255).\n"
+"     --threshold-sweep    Comma-separated list of thresholds to try, e.g. 35,45,60,80.\n"
+"                          The threshold producing the highest MSSIM is used.\n"
+"     --scales             Also match the masks resized by these factors given\n"
+"                          as min:max:step (e.g. 0.5:2.0:0.1) or a single value.\n"
+"                          The ROI is resized instead of the masks. Default: 1\n"
 " -r, --roi                Region of interest(ROI) as x,y,width,height.\n"
 "                          (width and height are equal to 1000000 by default)\n"
 " -m, --blur-margin        Blur margin relative to the ROI as top,right,bottom,left integers.\n"
 "                          Default: 0,0,0,0\n"
 " -s, --min-mssim          Minimum MSSIM value to consider a match successful.\n"
 "                          Possible values: 0..1 incl. Default: 0.1\n"
+"     --accept-mssim       Stop searching as soon as a match reaches this MSSIM\n"
+"                          value instead of trying all masks and thresholds.\n"
+"                          Default: 0 (off)\n"
+"     --mask-history       File with match counts of the masks. The masks\n"
+"                          matched most often are tried first. The file is\n"
+"                          updated on exit.\n"
+"     --multi              Redact all occurrences of the masks with MSSIM above\n"
+"                          -s value. Overlapping matches are merged.\n"
+"     --multi-score        Maximum normalized SQDIFF score (0..1, fraction of\n"
+"                          differing pixels) of the locations verified with\n"
+"                          MSSIM in --multi mode. Default: 0.25\n"
 " -T, --dry-run            Don't write to FS\n"
+"     --jpeg-region-write  For JPEG input and output, copy the untouched DCT\n"
+"                          blocks as is and re-encode only the MCUs touched by\n"
+"                          the blur.\n"
+"     --compile-masks      Compile mask images found in the directory and the\n"
+"                          mask arguments into a mask library written to -o file.\n"
+"     --mask-library       Load precompiled masks from the library file. Mask\n"
+"                          arguments are optional with this option.\n"
+" -j, --jobs               Number of threads used for matching. Default: 1\n"
+"     --pyramid-levels     Number of coarse-to-fine pyramid levels for template\n"
+"                          search. Default: 0 (exhaustive search)\n"
+"     --pyramid-candidates Number of coarse level locations refined on finer\n"
+"                          levels. Default: 4\n"
+"     --pyramid-check      Also run exhaustive search and report to stderr how\n"
+"                          often the pyramid search result differs from it\n"
+" -b, --batch              Process input,output pairs listed in a file (one pair\n"
+"                          per line separated by tab or comma; \"-\" means stdin)\n"
+"                          instead of -i and -o. The masks are loaded only once.\n"
+"                          A result line is printed for each pair.\n"
+"     --sequence           Process input,output pairs listed in a file (as -b)\n"
+"                          as frames of a video. Each frame is searched around\n"
+"                          the match of the previous one; the whole ROI is\n"
+"                          searched if MSSIM drops to -s value. Decoding,\n"
+"                          matching and encoding of the frames overlap.\n"
+"     --track-radius       Distance in pixels from the previous match searched\n"
+"                          in --sequence mode. Default: 32\n"
+"     --stats              Write statistics of each image as a line of JSON.\n"
+"                          Supported formats: json\n"
+"     --stats-file         File the statistics are appended to, e.g. /dev/fd/3.\n"
+"                          Default: stderr\n"
+"     --serve              Keep the masks loaded and serve requests on the Unix\n"
+"                          domain socket instead of processing -i and -o.\n"
+"     --serve-workers      Number of connections served concurrently. Default: 4\n"
+"     --serve-queue        Maximum number of connections waiting for a worker.\n"
+"                          Default: 64\n"
 "\nEXAMPLE:\n"
 "The following blurs a logo specified by logo19x24.jpg mask on in.jpg,\n"
 "sets 500px wide line at the bottom of in.jpg as the region of interest,\n"
 "writes the result to out.jpg:\n"
-"%1$s -r 0,-500 -t60 -i in.jpg -o out.jpg -v logo.jpg\n"};
+"%1$s -r 0,-500 -t60 -i in.jpg -o out.jpg -v logo.jpg\n"
+"\nBATCH OUTPUT:\n"
+"ok<TAB>input<TAB>output<TAB>mssim<TAB>x,y,width,height[;...]<TAB>threshold\n"
+"fail<TAB>input<TAB>output<TAB>error message\n"
+"\nSERVER PROTOCOL:\n"
+"Request is a list of key=value lines terminated with an empty line. Keys:\n"
+"input, input-size, output, output-format, roi, margin, threshold, scales,\n"
+"min-mssim, accept-mssim, kernel-size, deviation, redact, block-size, multi,\n"
+"multi-score, dry-run.\n"
+"input-size=N line means that N bytes of encoded image follow the empty line.\n"
+"Response has the same format with keys status, message, mssim, threshold, roi,\n"
+"output, output-size.\n"};
+
+/// Codes for long options having no short equivalents
+const int g_kOptThresholdSweep{256};
+const int g_kOptPyramidLevels{257};
+const int g_kOptPyramidCandidates{258};
+const int g_kOptPyramidCheck{259};
+const int g_kOptCompileMasks{260};
+const int g_kOptMaskLibrary{261};
+const int g_kOptJpegRegionWrite{262};
+const int g_kOptServe{263};
+const int g_kOptServeWorkers{264};
+const int g_kOptServeQueue{265};
+const int g_kOptStats{266};
+const int g_kOptStatsFile{267};
+const int g_kOptAcceptMssim{268};
+const int g_kOptMaskHistory{269};
+const int g_kOptRedact{270};
+const int g_kOptBlockSize{271};
+const int g_kOptMulti{272};
+const int g_kOptMultiScore{273};
+const int g_kOptScales{274};
+const int g_kOptSequence{275};
+const int g_kOptTrackRadius{276};
+
+/// Maximum number of --scales values
+const int g_kMaxScales{64};
+/// Maximum number of frames waiting for each stage in --sequence mode
+const size_t g_kSequenceQueueSize{4};
 
-const char *g_kShortOptions = "hvi:o:d:k:t:r:m:s:T";
+const char *g_kShortOptions = "hvi:o:d:k:t:r:m:s:Tb:j:";
 const struct option g_kLongOptions[] = {
   {"help",             no_argument,       NULL, 'h'},
   {"verbose",          no_argument,       NULL, 'v'},
@@ -109,37 +250,31 @@ const struct option g_kLongOptions[] = {
   {"blur-margin",      required_argument, NULL, 'm'},
   {"min-mssim",        required_argument, NULL, 's'},
   {"dry-run",          no_argument,       NULL, 'T'},
+  {"batch",            required_argument, NULL, 'b'},
+  {"sequence",         required_argument, NULL, g_kOptSequence},
+  {"track-radius",     required_argument, NULL, g_kOptTrackRadius},
+  {"jobs",             required_argument, NULL, 'j'},
+  {"threshold-sweep",  required_argument, NULL, g_kOptThresholdSweep},
+  {"scales",           required_argument, NULL, g_kOptScales},
+  {"pyramid-levels",   required_argument, NULL, g_kOptPyramidLevels},
+  {"pyramid-candidates", required_argument, NULL, g_kOptPyramidCandidates},
+  {"pyramid-check",    no_argument,       NULL, g_kOptPyramidCheck},
+  {"compile-masks",    required_argument, NULL, g_kOptCompileMasks},
+  {"mask-library",     required_argument, NULL, g_kOptMaskLibrary},
+  {"jpeg-region-write", no_argument,      NULL, g_kOptJpegRegionWrite},
+  {"accept-mssim",     required_argument, NULL, g_kOptAcceptMssim},
+  {"mask-history",     required_argument, NULL, g_kOptMaskHistory},
+  {"multi",            no_argument,       NULL, g_kOptMulti},
+  {"multi-score",      required_argument, NULL, g_kOptMultiScore},
+  {"redact",           required_argument, NULL, g_kOptRedact},
+  {"block-size",       required_argument, NULL, g_kOptBlockSize},
+  {"stats",            required_argument, NULL, g_kOptStats},
+  {"stats-file",       required_argument, NULL, g_kOptStatsFile},
+  {"serve",            required_argument, NULL, g_kOptServe},
+  {"serve-workers",    required_argument, NULL, g_kOptServeWorkers},
+  {"serve-queue",      required_argument, NULL, g_kOptServeQueue},
   {0,                  0,                 0,    0}
 };
 
-/////////////////////////////////////////////////////////////////////
-
-template<class T> T
-GetOptArg(const std::string& optarg, const char* format, ...)
-{
-  T result;
-  std::istringstream is(optarg);
-
-  if (is >> result) {
-    return result;
-  }
-
-  if (!format) {
-    throw ErrorException("Invalid error format in %s", __func__ );
-  }
-
-  std::string error;
-  va_list args;
-  va_start(args, format);
-  char message[1024];
-  const int message_len = vsnprintf(message, sizeof(message), format, args);
-  error = std::string(message, message_len);
-  va_end(args);
-  throw InvalidCliArgException(error);
-}
-
-template int GetOptArg(const std::string& optarg, const char* format, ...);
-template double GetOptArg(const std::string& optarg, const char* format, ...);
-
 #endif // MAIN_HXX
 // vim: et ts=2 sts=2 sw=2
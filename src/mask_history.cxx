@@ -0,0 +1,95 @@
+/* \file
+ *
+ * \copyright Copyright © 2015  Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include <stdio.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include "atomic_file.hxx"
+#include "mask_history.hxx"
+
+/////////////////////////////////////////////////////////////////////
+
+MaskHistory::MaskHistory(const std::string& filename)
+  : mFilename(filename)
+{
+  std::ifstream is(filename);
+  if (!is) {
+    // No history yet
+    return;
+  }
+
+  std::string line;
+  while (std::getline(is, line)) {
+    auto pos = line.find('\t');
+    if (pos == std::string::npos) {
+      continue;
+    }
+
+    std::istringstream hits_stream(line.substr(0, pos));
+    unsigned long hits;
+    if (hits_stream >> hits) {
+      mHits[line.substr(pos + 1)] = hits;
+    }
+  }
+}
+
+
+void
+MaskHistory::Sort(std::vector<Mask>& masks) const
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+
+  auto get_hits = [this](const Mask& mask) {
+    auto it = mHits.find(mask.file);
+    return it == mHits.end() ? 0 : it->second;
+  };
+
+  std::stable_sort(masks.begin(), masks.end(),
+      [&get_hits](const Mask& a, const Mask& b) {
+        return get_hits(a) > get_hits(b);
+      });
+}
+
+
+void
+MaskHistory::AddHit(const std::string& name)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  ++mHits[name];
+}
+
+
+void
+MaskHistory::Save() const
+{
+  // Replace the file atomically, so that concurrent runs never read
+  // a truncated history. Each run writes its own temporary file; the last
+  // one renamed wins.
+  AtomicFile file(mFilename);
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (auto& entry : mHits) {
+      fprintf(file.Get(), "%lu\t%s\n", entry.second, entry.first.c_str());
+    }
+  }
+  file.Commit();
+}
+
+// vim: et ts=2 sts=2 sw=2
@@ -0,0 +1,56 @@
+/* \file
+ *
+ * \copyright Copyright © 2015  Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#pragma once
+#ifndef MASK_HISTORY_HXX
+#define MASK_HISTORY_HXX
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "mask_library.hxx"
+
+/// Numbers of matches of the masks persisted between runs.
+///
+/// The file contains a line per mask: number of hits and the mask file name
+/// separated by tab.
+class MaskHistory
+{
+  public:
+    /// Loads history from `filename` if the file exists
+    explicit MaskHistory(const std::string& filename);
+
+    /// Sorts `masks` by the number of hits in descending order. Masks having
+    /// equal numbers of hits keep their order.
+    void Sort(std::vector<Mask>& masks) const;
+
+    /// Counts a match of mask `name`. Thread-safe.
+    void AddHit(const std::string& name);
+
+    /// Writes the history back to the file
+    void Save() const;
+
+  private:
+    std::string mFilename;
+    std::map<std::string, unsigned long> mHits;
+    mutable std::mutex mMutex;
+};
+
+#endif // MASK_HISTORY_HXX
+// vim: et ts=2 sts=2 sw=2
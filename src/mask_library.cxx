@@ -0,0 +1,236 @@
+/* \file
+ *
+ * \copyright Copyright © 2015  Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include "atomic_file.hxx"
+#include "exceptions.hxx"
+#include "mask_library.hxx"
+
+/////////////////////////////////////////////////////////////////////
+
+namespace {
+
+const char kMagic[8] = {'B', 'L', 'U', 'R', 'P', 'A', 'T', '\0'};
+const uint32_t kVersion = 1;
+/// Alignment of pixel data blocks
+const uint64_t kAlignment = 64;
+
+struct LibraryHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t count;
+  /// Offset of the LibraryEntry table
+  uint64_t entries_offset;
+};
+
+struct LibraryEntry {
+  uint64_t name_offset;
+  uint32_t name_length;
+  uint32_t rows;
+  uint32_t cols;
+  uint32_t reserved;
+  uint64_t gray_offset;
+  uint64_t inverted_offset;
+  double sum;
+  double sqsum;
+};
+
+
+/// Whether `length` bytes at `offset` lie within `size` bytes. Written so
+/// that crafted values can't wrap around.
+inline bool
+InBounds(uint64_t offset, uint64_t length, uint64_t size)
+{
+  return offset <= size && length <= size - offset;
+}
+
+
+inline uint64_t
+Align(uint64_t offset)
+{
+  return (offset + kAlignment - 1) / kAlignment * kAlignment;
+}
+
+
+/// Moves the position of `fp` to `offset`. The gaps are filled with zeros
+/// by the following writes.
+void
+Seek(FILE* fp, uint64_t offset)
+{
+  if (fseeko(fp, static_cast<off_t>(offset), SEEK_SET) != 0) {
+    throw ErrorException("failed to seek in mask library: %s", strerror(errno));
+  }
+}
+
+
+/// Writes continuous copy of 8-bit single-channel `img` at `offset`. Write
+/// errors are detected by AtomicFile::Commit().
+void
+WritePixels(FILE* fp, uint64_t offset, const cv::Mat& img)
+{
+  Seek(fp, offset);
+  for (int y = 0; y < img.rows; ++y) {
+    fwrite(img.ptr<uchar>(y), 1, img.cols, fp);
+  }
+}
+
+} // namespace
+
+/////////////////////////////////////////////////////////////////////
+
+MaskLibrary::MaskLibrary(const std::string& filename)
+{
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw ErrorException("failed to open mask library %s: %s",
+        filename.c_str(), strerror(errno));
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(LibraryHeader)) {
+    ::close(fd);
+    throw ErrorException("invalid mask library %s", filename.c_str());
+  }
+  mSize = st.st_size;
+
+  mData = mmap(NULL, mSize, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (mData == MAP_FAILED) {
+    mData = nullptr;
+    throw ErrorException("failed to map mask library %s: %s",
+        filename.c_str(), strerror(errno));
+  }
+
+  const char* base = static_cast<const char*>(mData);
+  const LibraryHeader* header = reinterpret_cast<const LibraryHeader*>(base);
+
+  bool valid = memcmp(header->magic, kMagic, sizeof(kMagic)) == 0
+    && header->version == kVersion
+    && header->entries_offset <= mSize
+    && header->entries_offset % alignof(LibraryEntry) == 0
+    && header->count <= (mSize - header->entries_offset) / sizeof(LibraryEntry);
+
+  const LibraryEntry* entries = valid
+    ? reinterpret_cast<const LibraryEntry*>(base + header->entries_offset)
+    : nullptr;
+
+  for (uint32_t i = 0; valid && i < header->count; ++i) {
+    const LibraryEntry& entry = entries[i];
+    const uint64_t size = static_cast<uint64_t>(entry.rows) * entry.cols;
+
+    valid = InBounds(entry.name_offset, entry.name_length, mSize)
+      && InBounds(entry.gray_offset, size, mSize)
+      && InBounds(entry.inverted_offset, size, mSize)
+      && entry.rows <= INT_MAX && entry.cols <= INT_MAX
+      && size > 0;
+    if (!valid) {
+      break;
+    }
+
+    Mask mask;
+    mask.file.assign(base + entry.name_offset, entry.name_length);
+    // The pages are read-only, so the masks are never written to
+    mask.gray = cv::Mat(entry.rows, entry.cols, CV_8UC1,
+        const_cast<char*>(base + entry.gray_offset));
+    mask.inverted = cv::Mat(entry.rows, entry.cols, CV_8UC1,
+        const_cast<char*>(base + entry.inverted_offset));
+    mask.stats.sum = entry.sum;
+    mask.stats.sqsum = entry.sqsum;
+    mMasks.push_back(mask);
+  }
+
+  if (!valid) {
+    munmap(mData, mSize);
+    mData = nullptr;
+    throw ErrorException("invalid mask library %s", filename.c_str());
+  }
+}
+
+
+MaskLibrary::~MaskLibrary()
+{
+  mMasks.clear();
+  if (mData) {
+    munmap(mData, mSize);
+  }
+}
+
+
+void
+MaskLibrary::Write(const std::string& filename, const std::vector<Mask>& masks)
+{
+  LibraryHeader header;
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.count = static_cast<uint32_t>(masks.size());
+  header.entries_offset = Align(sizeof(header));
+
+  std::vector<LibraryEntry> entries(masks.size());
+  uint64_t offset = header.entries_offset + sizeof(LibraryEntry) * masks.size();
+
+  for (size_t i = 0; i < masks.size(); ++i) {
+    const Mask& mask = masks[i];
+    LibraryEntry& entry = entries[i];
+    const uint64_t size = static_cast<uint64_t>(mask.gray.rows) * mask.gray.cols;
+
+    entry.name_offset = offset;
+    entry.name_length = static_cast<uint32_t>(mask.file.size());
+    entry.rows = mask.gray.rows;
+    entry.cols = mask.gray.cols;
+    entry.reserved = 0;
+    entry.gray_offset = Align(entry.name_offset + entry.name_length);
+    entry.inverted_offset = Align(entry.gray_offset + size);
+    entry.sum = mask.stats.sum;
+    entry.sqsum = mask.stats.sqsum;
+    offset = entry.inverted_offset + size;
+  }
+
+  // The library is replaced by rename(), since truncating it in place would
+  // break the processes having it mapped
+  AtomicFile out(filename);
+  FILE* fp = out.Get();
+
+  fwrite(&header, sizeof(header), 1, fp);
+  Seek(fp, header.entries_offset);
+  if (!entries.empty()) {
+    fwrite(&entries[0], sizeof(LibraryEntry), entries.size(), fp);
+  }
+
+  for (size_t i = 0; i < masks.size(); ++i) {
+    const Mask& mask = masks[i];
+    const LibraryEntry& entry = entries[i];
+
+    Seek(fp, entry.name_offset);
+    fwrite(mask.file.data(), 1, mask.file.size(), fp);
+    WritePixels(fp, entry.gray_offset, mask.gray);
+    WritePixels(fp, entry.inverted_offset, mask.inverted);
+  }
+
+  out.Commit();
+}
+
+// vim: et ts=2 sts=2 sw=2
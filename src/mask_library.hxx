@@ -0,0 +1,73 @@
+/* \file
+ *
+ * \copyright Copyright © 2015  Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#pragma once
+#ifndef MASK_LIBRARY_HXX
+#define MASK_LIBRARY_HXX
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+#include "match_engine.hxx"
+
+/// Mask image preprocessed for matching
+struct Mask {
+  std::string file;
+  /// Grayscale version of the mask
+  cv::Mat gray;
+  /// Inverted grayscale version of the mask
+  cv::Mat inverted;
+  /// Statistics of `gray` used by MatchEngine
+  TemplateStats stats;
+};
+
+/// Precompiled set of masks mapped into memory.
+///
+/// The file consists of a header, an entry table and data blocks. Each entry
+/// refers to the mask name, the grayscale and inverted pixels (stored
+/// contiguously and aligned to 64 bytes) and the template statistics. Numbers
+/// are stored in the native byte order.
+class MaskLibrary
+{
+  public:
+    /// Maps library `filename` into memory
+    explicit MaskLibrary(const std::string& filename);
+    ~MaskLibrary();
+
+    MaskLibrary(const MaskLibrary&) = delete;
+    MaskLibrary& operator=(const MaskLibrary&) = delete;
+
+    /// Masks referring to the mapped memory. The matrices are valid as long as
+    /// the library object exists, and must not be modified.
+    const std::vector<Mask>& Masks() const { return mMasks; }
+
+    /// Writes `masks` into library file `filename`. The file is replaced
+    /// atomically, so the processes having the old library mapped keep
+    /// reading it. Throws ErrorException on errors.
+    static void Write(const std::string& filename, const std::vector<Mask>& masks);
+
+  private:
+    void* mData{nullptr};
+    size_t mSize{0};
+    std::vector<Mask> mMasks;
+};
+
+#endif // MASK_LIBRARY_HXX
+// vim: et ts=2 sts=2 sw=2
@@ -0,0 +1,112 @@
+/* \file
+ *
+ * \copyright Copyright © 2015  Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include <cmath>
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "match_engine.hxx"
+
+/// Maximum pixel value of 8-bit image
+static const double kMaxPixelValue{255.};
+
+
+TemplateStats::TemplateStats(const cv::Mat& tpl)
+{
+  CV_Assert(tpl.type() == CV_8UC1);
+
+  for (int y = 0; y < tpl.rows; ++y) {
+    const uchar* p = tpl.ptr<uchar>(y);
+    for (int x = 0; x < tpl.cols; ++x) {
+      sum += p[x];
+      sqsum += static_cast<double>(p[x]) * p[x];
+    }
+  }
+}
+
+
+MatchEngine::MatchEngine(const cv::Mat& img)
+{
+  Reset(img);
+}
+
+
+void
+MatchEngine::Reset(const cv::Mat& img)
+{
+  CV_Assert(img.type() == CV_8UC1);
+  mImg = img;
+  cv::integral(img, mSum, mSqSum, CV_64F);
+  img.convertTo(mImg64, CV_64F);
+}
+
+
+void
+MatchEngine::Match(const cv::Mat& tpl, const TemplateStats& stats,
+    cv::Mat& result, cv::Mat& result_inverted) const
+{
+  CV_Assert(tpl.type() == CV_8UC1
+      && tpl.cols <= mImg.cols && tpl.rows <= mImg.rows);
+
+  const int w = tpl.cols;
+  const int h = tpl.rows;
+  const double area = static_cast<double>(w) * h;
+  const double tpl_sqsum = stats.sqsum;
+  // sum((255 - T)^2)
+  const double tpl_inv_sqsum = area * kMaxPixelValue * kMaxPixelValue
+    - 2 * kMaxPixelValue * stats.sum + stats.sqsum;
+
+  // The only per-template pass over the image. The correlation is computed
+  // in double precision: float CV_TM_CCORR has rounding errors far above the
+  // distance between integer scores, which reorders exact ties on binary
+  // images. The top-left anchor makes the valid part of the output the
+  // correlation map.
+  // Buffers reused by the calls made from the same thread
+  static thread_local cv::Mat tpl64;
+  static thread_local cv::Mat corr;
+  tpl.convertTo(tpl64, CV_64F);
+  cv::filter2D(mImg64, corr, CV_64F, tpl64, cv::Point(0, 0), 0, cv::BORDER_CONSTANT);
+
+  const int rows = mImg.rows - h + 1;
+  const int cols = mImg.cols - w + 1;
+  result.create(rows, cols, CV_64FC1);
+  result_inverted.create(rows, cols, CV_64FC1);
+
+  for (int y = 0; y < rows; ++y) {
+    const double* s0 = mSum.ptr<double>(y);
+    const double* s1 = mSum.ptr<double>(y + h);
+    const double* q0 = mSqSum.ptr<double>(y);
+    const double* q1 = mSqSum.ptr<double>(y + h);
+    const double* c = corr.ptr<double>(y);
+    double* r = result.ptr<double>(y);
+    double* ri = result_inverted.ptr<double>(y);
+
+    for (int x = 0; x < cols; ++x) {
+      const double sum = s1[x + w] - s1[x] - s0[x + w] + s0[x];
+      const double sqsum = q1[x + w] - q1[x] - q0[x + w] + q0[x];
+      // Correlation of 8-bit images is an integer, so rounding removes the
+      // error of the DFT and the scores are exact
+      const double cc = std::round(c[x]);
+      const double cc_inv = kMaxPixelValue * sum - cc;
+
+      r[x] = sqsum - 2 * cc + tpl_sqsum;
+      ri[x] = sqsum - 2 * cc_inv + tpl_inv_sqsum;
+    }
+  }
+}
+
+// vim: et ts=2 sts=2 sw=2
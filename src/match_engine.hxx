@@ -0,0 +1,78 @@
+/* \file
+ *
+ * \copyright Copyright © 2015  Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#pragma once
+#ifndef MATCH_ENGINE_HXX
+#define MATCH_ENGINE_HXX
+
+#include <opencv2/core/core.hpp>
+
+/// Sums of template pixels used by MatchEngine
+struct TemplateStats {
+  /// Sum of pixel values
+  double sum{0.};
+  /// Sum of squared pixel values
+  double sqsum{0.};
+
+  TemplateStats() {}
+  /// Computes statistics of 8-bit single-channel template
+  explicit TemplateStats(const cv::Mat& tpl);
+};
+
+/// SQDIFF template matching sharing the work between template polarities.
+///
+/// For window W at (x, y) SQDIFF = S2(W) - 2 * C(W) + T2, where S2(W) is the
+/// sum of squared image pixels, C(W) is the cross-correlation of the image
+/// and the template T, and T2 is the sum of squared template pixels. For the
+/// inverted template 255 - T the cross-correlation is 255 * S(W) - C(W), where
+/// S(W) is the sum of image pixels. So the integral images are computed once
+/// per image, and a single cross-correlation per template gives the score
+/// maps for both the template and its inverted version. The scores are exact
+/// (CV_64F), so the best location is the first lowest SQDIFF in scan order.
+class MatchEngine
+{
+  public:
+    MatchEngine() {}
+    /// \param img 8-bit single-channel image to search on
+    explicit MatchEngine(const cv::Mat& img);
+
+    /// Switches to `img` reusing the buffers of the integral images if the
+    /// size doesn't change
+    void Reset(const cv::Mat& img);
+
+    /// Computes SQDIFF maps for `tpl` and its inverted version.
+    /// \param tpl 8-bit single-channel template no larger than the image
+    /// \param stats Statistics of `tpl`
+    /// \param result Score map for `tpl` (CV_64F)
+    /// \param result_inverted Score map for the inverted `tpl` (CV_64F)
+    void Match(const cv::Mat& tpl, const TemplateStats& stats,
+        cv::Mat& result, cv::Mat& result_inverted) const;
+
+    const cv::Mat& Image() const { return mImg; }
+
+  private:
+    cv::Mat mImg;
+    /// `mImg` converted to CV_64F for the cross-correlation
+    cv::Mat mImg64;
+    /// Integral image of pixel values (CV_64F)
+    cv::Mat mSum;
+    /// Integral image of squared pixel values (CV_64F)
+    cv::Mat mSqSum;
+};
+
+#endif // MATCH_ENGINE_HXX
+// vim: et ts=2 sts=2 sw=2
@@ -0,0 +1,764 @@
+/* \file
+ *
+ * \copyright Copyright © 2015  Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <cmath>
+#include <functional>
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "log.hxx"
+#include "matcher.hxx"
+#include "ssim.hxx"
+
+/////////////////////////////////////////////////////////////////////
+
+namespace {
+
+/// Color used by cv::threshold()
+const int kThresholdColor{255};
+/// Maximum allowed difference between GetGrayMSSIM() and GetMSSIM() results
+/// in debug builds
+const double kMSSIMTolerance{1e-3};
+/// Template is never downsampled below this size (in pixels) by the pyramid
+/// levels, nor by the scales below 1
+const int kPyramidMinTemplateSize{8};
+/// Half-size of the window searched around a candidate on a finer level
+const int kPyramidRefineRadius{2};
+/// Parameters of GetMSSIM()
+const int kSsimWindowSize{11};
+const double kSsimSigma{1.5};
+const double kSsimC1{6.5025};
+const double kSsimC2{58.5225};
+/// Margin added to GetMSSIMUpperBound() results to cover the rounding errors
+/// of the SQDIFF maps and GetGrayMSSIM()
+const double kMSSIMBoundTolerance{1e-3};
+/// Scales closer to 1 than this are considered equal to 1
+const double kScaleTolerance{1e-6};
+
+} // namespace
+
+/////////////////////////////////////////////////////////////////////
+
+cv::Scalar
+GetMSSIM(const cv::Mat& i1, const cv::Mat& i2)
+{
+  const double C1 = 6.5025, C2 = 58.5225;
+  int d           = CV_32F;
+
+  cv::Mat I1, I2;
+  i1.convertTo(I1, d); // cannot calculate on one byte large values
+  i2.convertTo(I2, d);
+
+  cv::Mat I2_2  = I2.mul(I2); // I2^2
+  cv::Mat I1_2  = I1.mul(I1); // I1^2
+  cv::Mat I1_I2 = I1.mul(I2); // I1 * I2
+
+
+  cv::Mat mu1, mu2;
+  cv::GaussianBlur(I1, mu1, cv::Size(11, 11), 1.5);
+  cv::GaussianBlur(I2, mu2, cv::Size(11, 11), 1.5);
+
+  cv::Mat mu1_2   = mu1.mul(mu1);
+  cv::Mat mu2_2   = mu2.mul(mu2);
+  cv::Mat mu1_mu2 = mu1.mul(mu2);
+
+  cv::Mat sigma1_2, sigma2_2, sigma12;
+
+  cv::GaussianBlur(I1_2, sigma1_2, cv::Size(11, 11), 1.5);
+  sigma1_2 -= mu1_2;
+
+  cv::GaussianBlur(I2_2, sigma2_2, cv::Size(11, 11), 1.5);
+  sigma2_2 -= mu2_2;
+
+  cv::GaussianBlur(I1_I2, sigma12, cv::Size(11, 11), 1.5);
+  sigma12 -= mu1_mu2;
+
+  cv::Mat t1, t2, t3;
+
+  t1 = 2 * mu1_mu2 + C1;
+  t2 = 2 * sigma12 + C2;
+  t3 = t1.mul(t2);  // t3 = ((2*mu1_mu2 + C1).*(2*sigma12 + C2))
+
+  t1 = mu1_2 + mu2_2 + C1;
+  t2 = sigma1_2 + sigma2_2 + C2;
+  t1 = t1.mul(t2); // t1 =((mu1_2 + mu2_2 + C1).*(sigma1_2 + sigma2_2 + C2))
+
+  cv::Mat ssim_map;
+  cv::divide(t3, t1, ssim_map); // ssim_map =  t3./t1;
+
+  cv::Scalar mssim = cv::mean(ssim_map); // mssim = average of ssim map
+  return mssim;
+}
+
+
+double
+GetAvgMSSIM(const cv::Mat& i1, const cv::Mat& i2)
+{
+  if (i1.type() == CV_8UC1 && i2.type() == CV_8UC1) {
+    // Missing channels of grayscale images used to be averaged as zeros. The
+    // scale is kept, so the scores and -s values remain comparable.
+    auto mssim = GetGrayMSSIM(i1, i2);
+#if defined(DEBUG)
+    auto expected = GetMSSIM(i1, i2).val[0];
+    if (std::fabs(mssim - expected) > kMSSIMTolerance) {
+      ERROR_LOG("GetGrayMSSIM() = %f differs from GetMSSIM() = %f", mssim, expected);
+    }
+#endif
+    return mssim / 3;
+  }
+
+  auto mssim = GetMSSIM(i1, i2);
+  return (mssim.val[0] + mssim.val[1] + mssim.val[2]) / 3;
+}
+
+
+void
+MatchTemplateExhaustive(cv::Point& match_loc, const cv::Mat& img, const cv::Mat& tpl)
+{
+  cv::Mat result;
+  cv::matchTemplate(img, tpl, result, CV_TM_SQDIFF);
+
+  // For SQDIFF the best match is the lowest value. The location doesn't
+  // depend on the scale of the map, so it is not normalized.
+  double min_val;
+  cv::minMaxLoc(result, &min_val, NULL, &match_loc, NULL, cv::Mat());
+}
+
+
+/// Finds up to `k` best (lowest) locations of SQDIFF result map with values
+/// below `max_val`. Neighbourhood of each found location is suppressed before
+/// searching for the next one.
+/// \param values Values of the locations (optional)
+static std::vector<cv::Point>
+GetTopMinima(cv::Mat& result, int k, const cv::Size& suppress_size,
+    double max_val = FLT_MAX, std::vector<double>* values = NULL)
+{
+  std::vector<cv::Point> minima;
+  const cv::Rect result_rect(0, 0, result.cols, result.rows);
+
+  while (static_cast<int>(minima.size()) < k) {
+    double min_val;
+    cv::Point min_loc;
+    cv::minMaxLoc(result, &min_val, NULL, &min_loc, NULL, cv::Mat());
+    if (min_val >= max_val) {
+      break;
+    }
+    minima.push_back(min_loc);
+    if (values) values->push_back(min_val);
+
+    cv::Rect suppress_rect(min_loc.x - suppress_size.width / 2,
+        min_loc.y - suppress_size.height / 2,
+        suppress_size.width + 1, suppress_size.height + 1);
+    result(suppress_rect & result_rect).setTo(cv::Scalar(FLT_MAX));
+  }
+
+  return minima;
+}
+
+
+/// Searches for matching pattern using coarse-to-fine image pyramid.
+///
+/// The best `opts.pyramid_candidates` locations found on the coarsest level are
+/// refined within small windows on each finer level. Falls back to
+/// MatchTemplateExhaustive() if the template is too small to be downsampled.
+/// \returns `false`, if fell back to the exhaustive search
+static bool
+MatchTemplatePyramid(cv::Point& match_loc, const cv::Mat& img, const cv::Mat& tpl,
+    const MatchOptions& opts)
+{
+  int levels = 0;
+  while (levels < opts.pyramid_levels
+      && (std::min(tpl.cols, tpl.rows) >> (levels + 1)) >= kPyramidMinTemplateSize) {
+    ++levels;
+  }
+  if (levels == 0) {
+    MatchTemplateExhaustive(match_loc, img, tpl);
+    return false;
+  }
+
+  std::vector<cv::Mat> img_pyr(levels + 1), tpl_pyr(levels + 1);
+  img_pyr[0] = img;
+  tpl_pyr[0] = tpl;
+  for (int i = 1; i <= levels; ++i) {
+    cv::pyrDown(img_pyr[i - 1], img_pyr[i]);
+    cv::pyrDown(tpl_pyr[i - 1], tpl_pyr[i]);
+  }
+
+  // Exhaustive search on the coarsest level
+  cv::Mat result;
+  cv::matchTemplate(img_pyr[levels], tpl_pyr[levels], result, CV_TM_SQDIFF);
+  auto candidates = GetTopMinima(result, opts.pyramid_candidates, tpl_pyr[levels].size());
+
+  // Refinement on finer levels
+  double best_val{DBL_MAX};
+  for (int level = levels - 1; level >= 0; --level) {
+    const cv::Mat& level_img = img_pyr[level];
+    const cv::Mat& level_tpl = tpl_pyr[level];
+    const cv::Rect result_rect(0, 0,
+        level_img.cols - level_tpl.cols + 1,
+        level_img.rows - level_tpl.rows + 1);
+
+    best_val = DBL_MAX;
+    std::vector<cv::Point> refined;
+    for (auto& candidate : candidates) {
+      cv::Rect window(candidate.x * 2 - kPyramidRefineRadius,
+          candidate.y * 2 - kPyramidRefineRadius,
+          kPyramidRefineRadius * 2 + 1,
+          kPyramidRefineRadius * 2 + 1);
+      window &= result_rect;
+      if (window.area() == 0) {
+        continue;
+      }
+
+      cv::Mat window_result;
+      cv::matchTemplate(level_img(cv::Rect(window.x, window.y,
+              window.width + level_tpl.cols - 1,
+              window.height + level_tpl.rows - 1)),
+          level_tpl, window_result, CV_TM_SQDIFF);
+
+      double min_val;
+      cv::Point min_loc;
+      cv::minMaxLoc(window_result, &min_val, NULL, &min_loc, NULL, cv::Mat());
+      min_loc.x += window.x;
+      min_loc.y += window.y;
+
+      if (std::find(refined.begin(), refined.end(), min_loc) != refined.end()) {
+        continue;
+      }
+      refined.push_back(min_loc);
+
+      if (min_val < best_val) {
+        best_val = min_val;
+        match_loc = min_loc;
+      }
+    }
+    candidates.swap(refined);
+  }
+
+  if (candidates.empty()) {
+    MatchTemplateExhaustive(match_loc, img, tpl);
+    return false;
+  }
+
+  return true;
+}
+
+
+void
+MatchTemplate(cv::Point& match_loc, const cv::Mat& img, const cv::Mat& tpl,
+    const MatchOptions& opts)
+{
+  if (opts.pyramid_levels <= 0) {
+    MatchTemplateExhaustive(match_loc, img, tpl);
+    return;
+  }
+
+  PyramidStats* stats = opts.pyramid_stats;
+  if (stats) ++stats->searches;
+  if (!MatchTemplatePyramid(match_loc, img, tpl, opts)) {
+    if (stats) ++stats->fallbacks;
+    return;
+  }
+
+  if (opts.pyramid_check) {
+    cv::Point exhaustive_loc;
+    MatchTemplateExhaustive(exhaustive_loc, img, tpl);
+    if (!(exhaustive_loc == match_loc)) {
+      if (stats) ++stats->mismatches;
+      VERBOSE_LOG2("pyramid match (%d, %d) differs from exhaustive match (%d, %d)",
+          match_loc.x, match_loc.y, exhaustive_loc.x, exhaustive_loc.y);
+    }
+  }
+}
+
+
+/// Returns minimum total weight a pixel of `length` pixels long line gets
+/// from the 11-tap Gaussian windows of GetMSSIM() with reflected borders
+static double
+GetMinWindowWeight(int length)
+{
+  double kernel[kSsimWindowSize];
+  double kernel_sum{0.};
+  for (int k = 0; k < kSsimWindowSize; ++k) {
+    const double x = k - kSsimWindowSize / 2;
+    kernel[k] = std::exp(-x * x / (2 * kSsimSigma * kSsimSigma));
+    kernel_sum += kernel[k];
+  }
+
+  std::vector<double> weights(length, 0.);
+  for (int p = 0; p < length; ++p) {
+    for (int k = 0; k < kSsimWindowSize; ++k) {
+      weights[cv::borderInterpolate(p + k - kSsimWindowSize / 2, length,
+          cv::BORDER_REFLECT_101)] += kernel[k] / kernel_sum;
+    }
+  }
+
+  return *std::min_element(weights.begin(), weights.end());
+}
+
+
+/// Returns upper bound of GetAvgMSSIM() of 8-bit grayscale template of `size`
+/// and a window whose sum of squared differences from the template is `sqdiff`.
+///
+/// SSIM = l * cs, where l <= 1, and 1 - SSIM >= max(1 - l, 1 - cs) (SSIM is
+/// negative if cs is). 1 - l = (mu1 - mu2)^2 / (mu1^2 + mu2^2 + C1) and
+/// 1 - cs = sigma_{1-2}^2 / (sigma1^2 + sigma2^2 + C2). For 8-bit pixels the
+/// denominators don't exceed A = 2 * 255^2 + C1 and B = 255^2 / 2 + C2, so
+/// 1 - SSIM >= ((mu1 - mu2)^2 + sigma_{1-2}^2) / (A + B), where the numerator
+/// is the window-weighted mean of squared differences. Averaged over the
+/// pixels, every squared difference is counted with the weight of at least
+/// `GetMinWindowWeight(width) * GetMinWindowWeight(height)`.
+static double
+GetMSSIMUpperBound(const cv::Size& size, double sqdiff)
+{
+  const double A = 2 * 255. * 255. + kSsimC1;
+  const double B = 255. * 255. / 2 + kSsimC2;
+  const double weight = GetMinWindowWeight(size.width) * GetMinWindowWeight(size.height);
+
+  const double bound = 1. - weight * std::max(0., sqdiff) / (size.area() * (A + B));
+  // The same scale as in GetAvgMSSIM()
+  return bound / 3 + kMSSIMBoundTolerance;
+}
+
+
+/// Atomically raises `value` to `x`
+static void
+UpdateMax(std::atomic<double>& value, double x)
+{
+  double current = value;
+  while (x > current && !value.compare_exchange_weak(current, x)) {
+  }
+}
+
+
+/// Calls `job(i)` for each `i` in [0, n). If `accepted` is not `NULL`, the
+/// jobs run in index order in waves of the pool size, and no more waves are
+/// started after `*accepted` is set.
+static void
+RunJobs(ThreadPool& pool, size_t n, const std::atomic<bool>* accepted,
+    const std::function<void(size_t)>& job)
+{
+  if (!accepted) {
+    pool.ParallelFor(n, job);
+    return;
+  }
+
+  const size_t wave = std::max(1u, pool.Size());
+  for (size_t begin = 0; begin < n && !*accepted; begin += wave) {
+    pool.ParallelFor(std::min(wave, n - begin), [&](size_t i) { job(begin + i); });
+  }
+}
+
+
+/// Builds thresholded versions of `gray` and of its inverted version
+static void
+ThresholdImages(const cv::Mat& gray, double threshold, cv::Mat& in_img,
+    cv::Mat& in_img_inverted, RunStats* stats)
+{
+  StageTimer timer(stats, RunStats::kThreshold);
+  timer.Add(gray);
+  timer.Add(gray);
+
+  // Create inverted version of input image
+  cv::bitwise_not(gray, in_img_inverted);
+
+  // Suppress noise
+  cv::threshold(gray, in_img, threshold, kThresholdColor, CV_THRESH_BINARY);
+  cv::threshold(in_img_inverted, in_img_inverted, threshold, kThresholdColor, CV_THRESH_BINARY);
+}
+
+
+/// Working buffers of FindPattern() and FindPatterns() reused by the calls
+/// made from the same thread, so that the frames of a sequence (or images of
+/// the same size in general) don't allocate them again
+struct MatchScratch {
+  cv::Mat in_img;
+  cv::Mat in_img_inverted;
+  MatchEngine engines[2];
+};
+
+
+static MatchScratch&
+GetMatchScratch()
+{
+  static thread_local MatchScratch scratch;
+  return scratch;
+}
+
+
+/// Resets `engine` to `img` accounting the integral images as the match stage
+static void
+ResetEngine(MatchEngine& engine, const cv::Mat& img, RunStats* stats)
+{
+  StageTimer timer(stats, RunStats::kMatch);
+  timer.Add(img);
+  engine.Reset(img);
+}
+
+
+MatchResult
+FindPattern(const cv::Mat& gray, double threshold,
+    const std::vector<Mask>& masks, ThreadPool& pool, const MatchOptions& opts,
+    double best_mssim, RunStats* stats)
+{
+  auto& scratch = GetMatchScratch();
+  const cv::Mat& in_img = scratch.in_img;
+  const cv::Mat& in_img_inverted = scratch.in_img_inverted;
+  MatchResult result;
+  result.threshold = threshold;
+
+  ThresholdImages(gray, threshold, scratch.in_img, scratch.in_img_inverted, stats);
+
+  // Each (mask, image polarity) combination is an independent job. The
+  // candidates are merged in the order of the serial loops, so the result
+  // doesn't depend on the number of threads.
+  const cv::Mat images[2] = {in_img, in_img_inverted};
+  std::vector<MatchCandidate> candidates(masks.size() * 4);
+
+  // With early termination the search stops after the first candidate (in
+  // the serial order) reaching `opts.accept_mssim`. All of the candidates
+  // preceding it are evaluated, so the result is still deterministic.
+  const bool accept_enabled = opts.accept_mssim > 0;
+  std::atomic<bool> accepted{false};
+
+  if (opts.pyramid_levels > 0) {
+    RunJobs(pool, candidates.size(), accept_enabled ? &accepted : NULL, [&](size_t i) {
+      auto& mask = masks[i / 4];
+      auto& img = images[(i / 2) % 2];
+      auto& tpl = (i % 2) ? mask.inverted : mask.gray;
+      auto& candidate = candidates[i];
+
+      if (tpl.empty() || tpl.cols > img.cols || tpl.rows > img.rows) {
+        return;
+      }
+
+      // Find best matching location for current mask
+      cv::Point match_loc;
+      {
+        StageTimer timer(stats, RunStats::kMatch);
+        timer.Add(img);
+        MatchTemplate(match_loc, img, tpl, opts);
+      }
+
+      // Calculate similarity coefficient
+      StageTimer timer(stats, RunStats::kSsim);
+      timer.Add(tpl);
+      candidate.roi = cv::Rect(match_loc.x, match_loc.y, tpl.cols, tpl.rows);
+      candidate.mssim = GetAvgMSSIM(tpl, img(candidate.roi));
+      if (accept_enabled && candidate.mssim >= opts.accept_mssim) {
+        accepted = true;
+      }
+    });
+  } else {
+    // Both template polarities are scored from a single cross-correlation
+    // using the integral images shared by all masks
+    const MatchEngine (&engines)[2] = scratch.engines;
+    ResetEngine(scratch.engines[0], in_img, stats);
+    ResetEngine(scratch.engines[1], in_img_inverted, stats);
+
+    // Candidates whose MSSIM can't exceed the best one found so far (nor
+    // reach the accept threshold) are not verified
+    std::atomic<double> best{best_mssim};
+    const double max_prune_mssim = accept_enabled ? opts.accept_mssim : DBL_MAX;
+
+    RunJobs(pool, candidates.size() / 2, accept_enabled ? &accepted : NULL, [&](size_t i) {
+      auto& mask = masks[i / 2];
+      auto& engine = engines[i % 2];
+      auto& img = engine.Image();
+
+      if (mask.gray.empty() || mask.gray.cols > img.cols || mask.gray.rows > img.rows) {
+        return;
+      }
+
+      // Score maps of the jobs run by this thread
+      static thread_local cv::Mat results[2];
+      cv::Point match_locs[2];
+      double min_vals[2];
+      {
+        StageTimer timer(stats, RunStats::kMatch);
+        timer.Add(img);
+        engine.Match(mask.gray, mask.stats, results[0], results[1]);
+
+        for (int polarity = 0; polarity < 2; ++polarity) {
+          cv::minMaxLoc(results[polarity], &min_vals[polarity], NULL,
+              &match_locs[polarity], NULL, cv::Mat());
+        }
+      }
+
+      StageTimer timer(stats, RunStats::kSsim);
+      for (int polarity = 0; polarity < 2; ++polarity) {
+        auto& tpl = polarity ? mask.inverted : mask.gray;
+        auto& candidate = candidates[i * 2 + polarity];
+        auto& match_loc = match_locs[polarity];
+
+        const double bound = GetMSSIMUpperBound(tpl.size(), min_vals[polarity]);
+        if (bound < std::min(static_cast<double>(best), max_prune_mssim)) {
+          VERBOSE_LOG2("pruned %s polarity %d: MSSIM bound %f",
+              mask.file.c_str(), polarity, bound);
+          continue;
+        }
+
+        // Calculate similarity coefficient
+        candidate.roi = cv::Rect(match_loc.x, match_loc.y, tpl.cols, tpl.rows);
+        candidate.mssim = GetAvgMSSIM(tpl, img(candidate.roi));
+        timer.Add(tpl);
+
+        UpdateMax(best, candidate.mssim);
+        if (accept_enabled && candidate.mssim >= opts.accept_mssim) {
+          accepted = true;
+        }
+      }
+    });
+  }
+
+  for (size_t i = 0; i < candidates.size(); ++i) {
+    auto& candidate = candidates[i];
+    auto& roi = candidate.roi;
+    if (roi.area() == 0) {
+      continue;
+    }
+
+    VERBOSE_LOG2("ROI: (%d, %d) %dx%d", roi.x, roi.y, roi.width, roi.height);
+    VERBOSE_LOG2("MSSIM for %s: %f", masks[i / 4].file.c_str(), candidate.mssim);
+
+    if (stats) {
+      stats->AddCandidate({masks[i / 4].file, static_cast<int>((i / 2) % 2),
+          static_cast<int>(i % 2), threshold, candidate.mssim, roi});
+    }
+
+    if (accept_enabled && candidate.mssim >= opts.accept_mssim) {
+      result.mssim = candidate.mssim;
+      result.roi = roi;
+      result.mask = static_cast<int>(i / 4);
+      break;
+    }
+    if (candidate.mssim > result.mssim) {
+      result.mssim = candidate.mssim;
+      result.roi = roi;
+      result.mask = static_cast<int>(i / 4);
+    }
+  }
+
+  return result;
+}
+
+
+std::vector<MatchResult>
+FindPatterns(const cv::Mat& gray, double threshold,
+    const std::vector<Mask>& masks, ThreadPool& pool, const MatchOptions& opts,
+    double min_mssim, RunStats* stats)
+{
+  auto& scratch = GetMatchScratch();
+  ThresholdImages(gray, threshold, scratch.in_img, scratch.in_img_inverted, stats);
+
+  const MatchEngine (&engines)[2] = scratch.engines;
+  ResetEngine(scratch.engines[0], scratch.in_img, stats);
+  ResetEngine(scratch.engines[1], scratch.in_img_inverted, stats);
+
+  // Verified locations of each (mask, image polarity) job in the order of
+  // template polarity and score
+  struct Location {
+    int template_polarity;
+    MatchResult match;
+  };
+  std::vector<std::vector<Location>> locations(masks.size() * 2);
+
+  pool.ParallelFor(locations.size(), [&](size_t i) {
+    auto& mask = masks[i / 2];
+    auto& engine = engines[i % 2];
+    auto& img = engine.Image();
+
+    if (mask.gray.empty() || mask.gray.cols > img.cols || mask.gray.rows > img.rows) {
+      return;
+    }
+
+    static thread_local cv::Mat results[2];
+    std::vector<cv::Point> minima[2];
+    std::vector<double> values[2];
+    {
+      StageTimer timer(stats, RunStats::kMatch);
+      timer.Add(img);
+      engine.Match(mask.gray, mask.stats, results[0], results[1]);
+
+      // Both polarities of the template have the same size
+      const double max_sqdiff = opts.max_score * mask.gray.size().area() * 255. * 255.;
+      for (int polarity = 0; polarity < 2; ++polarity) {
+        minima[polarity] = GetTopMinima(results[polarity], opts.max_locations,
+            mask.gray.size(), max_sqdiff, &values[polarity]);
+      }
+    }
+
+    StageTimer timer(stats, RunStats::kSsim);
+    for (int polarity = 0; polarity < 2; ++polarity) {
+      auto& tpl = polarity ? mask.inverted : mask.gray;
+
+      for (size_t k = 0; k < minima[polarity].size(); ++k) {
+        // MSSIM of the location can't exceed the bound
+        if (GetMSSIMUpperBound(tpl.size(), values[polarity][k]) <= min_mssim) {
+          continue;
+        }
+
+        Location location;
+        location.template_polarity = polarity;
+        location.match.threshold = threshold;
+        location.match.mask = static_cast<int>(i / 2);
+        location.match.roi = cv::Rect(minima[polarity][k], tpl.size());
+        location.match.mssim = GetAvgMSSIM(tpl, img(location.match.roi));
+        timer.Add(tpl);
+        locations[i].push_back(location);
+      }
+    }
+  });
+
+  std::vector<MatchResult> matches;
+  for (size_t i = 0; i < locations.size(); ++i) {
+    for (auto& location : locations[i]) {
+      auto& match = location.match;
+      auto& roi = match.roi;
+
+      VERBOSE_LOG2("ROI: (%d, %d) %dx%d", roi.x, roi.y, roi.width, roi.height);
+      VERBOSE_LOG2("MSSIM for %s: %f", masks[i / 2].file.c_str(), match.mssim);
+
+      if (stats) {
+        stats->AddCandidate({masks[i / 2].file, static_cast<int>(i % 2),
+            location.template_polarity, threshold, match.mssim, roi});
+      }
+
+      if (match.mssim > min_mssim) {
+        matches.push_back(match);
+      }
+    }
+  }
+
+  SuppressOverlaps(matches, opts.max_overlap);
+  return matches;
+}
+
+
+/// Returns `masks` resized by `scale` (below 1). The masks getting smaller
+/// than kPyramidMinTemplateSize are left empty and skipped by the search,
+/// since MSSIM of a few pixels is high almost anywhere. The indices of the
+/// masks don't change.
+/// \returns `false` if all of the masks are too small
+static bool
+ScaleMasks(const std::vector<Mask>& masks, double scale, std::vector<Mask>& scaled)
+{
+  bool any = false;
+  scaled.resize(masks.size());
+  for (size_t i = 0; i < masks.size(); ++i) {
+    const Mask& mask = masks[i];
+    Mask& scaled_mask = scaled[i];
+    const cv::Size size(cvRound(mask.gray.cols * scale), cvRound(mask.gray.rows * scale));
+
+    scaled_mask.file = mask.file;
+    if (std::min(size.width, size.height) < kPyramidMinTemplateSize) {
+      continue;
+    }
+    any = true;
+    cv::resize(mask.gray, scaled_mask.gray, size, 0, 0, cv::INTER_AREA);
+    cv::bitwise_not(scaled_mask.gray, scaled_mask.inverted);
+    scaled_mask.stats = TemplateStats(scaled_mask.gray);
+  }
+  return any;
+}
+
+
+std::vector<ScaleLevel>
+BuildScaleLevels(const cv::Mat& gray, const std::vector<Mask>& masks,
+    const std::vector<double>& scales, RunStats* stats)
+{
+  std::vector<double> sorted(scales);
+  if (sorted.empty()) {
+    sorted.push_back(1.);
+  }
+  std::stable_sort(sorted.begin(), sorted.end(), [](double a, double b) {
+      return std::fabs(std::log(a)) < std::fabs(std::log(b));
+      });
+
+  StageTimer timer(stats, RunStats::kThreshold);
+  std::vector<ScaleLevel> levels;
+  for (auto scale : sorted) {
+    ScaleLevel level;
+    level.scale = scale;
+
+    if (std::fabs(scale - 1.) < kScaleTolerance) {
+      // The original image and masks
+      level.gray = gray;
+    } else if (scale < 1.) {
+      // Shrinking the masks keeps the image at its size. Enlarging the image
+      // instead would multiply the matching cost by 1 / scale^2.
+      if (!ScaleMasks(masks, scale, level.masks)) {
+        continue;
+      }
+      level.gray = gray;
+      for (auto& mask : level.masks) {
+        timer.Add(mask.gray);
+      }
+    } else {
+      const cv::Size size(cvRound(gray.cols / scale), cvRound(gray.rows / scale));
+      if (size.area() == 0) {
+        continue;
+      }
+      // Area interpolation avoids aliasing on downscaling
+      cv::resize(gray, level.gray, size, 0, 0, cv::INTER_AREA);
+      level.image_scale = scale;
+      timer.Add(level.gray);
+    }
+    levels.push_back(level);
+  }
+  return levels;
+}
+
+
+cv::Rect
+ScaleRect(const cv::Rect& rect, double scale)
+{
+  const int x0 = cvRound(rect.x * scale);
+  const int y0 = cvRound(rect.y * scale);
+  const int x1 = cvRound((rect.x + rect.width) * scale);
+  const int y1 = cvRound((rect.y + rect.height) * scale);
+  return cv::Rect(x0, y0, x1 - x0, y1 - y0);
+}
+
+
+void
+SuppressOverlaps(std::vector<MatchResult>& matches, double max_overlap)
+{
+  std::stable_sort(matches.begin(), matches.end(),
+      [](const MatchResult& a, const MatchResult& b) { return a.mssim > b.mssim; });
+
+  std::vector<MatchResult> kept;
+  for (auto& match : matches) {
+    bool suppressed = false;
+    for (auto& better : kept) {
+      const int overlap = (match.roi & better.roi).area();
+      if (overlap > max_overlap * std::min(match.roi.area(), better.roi.area())) {
+        suppressed = true;
+        break;
+      }
+    }
+    if (!suppressed) {
+      kept.push_back(match);
+    }
+  }
+  matches.swap(kept);
+}
+
+// vim: et ts=2 sts=2 sw=2
@@ -0,0 +1,168 @@
+/* \file
+ *
+ * \copyright Copyright © 2015  Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#pragma once
+#ifndef MATCHER_HXX
+#define MATCHER_HXX
+
+#include <atomic>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+#include "mask_library.hxx"
+#include "stats.hxx"
+#include "thread_pool.hxx"
+
+/// Counters of the pyramid search
+struct PyramidStats {
+  std::atomic<int> searches{0};
+  /// Searches performed exhaustively because of small templates
+  std::atomic<int> fallbacks{0};
+  /// Pyramid searches whose results differ from exhaustive ones
+  std::atomic<int> mismatches{0};
+};
+
+/// Parameters of the template search
+struct MatchOptions {
+  /// Number of pyramid levels used by MatchTemplate(). 0 means exhaustive search.
+  int pyramid_levels{0};
+  /// Number of best coarse level locations refined on finer levels
+  int pyramid_candidates{4};
+  /// Whether to compare pyramid search results with exhaustive search
+  bool pyramid_check{false};
+  /// Pyramid search counters updated if not `NULL`
+  PyramidStats* pyramid_stats{NULL};
+  /// The search stops as soon as a candidate reaches this MSSIM. 0 disables
+  /// early termination.
+  double accept_mssim{0.};
+  /// Maximum normalized SQDIFF score (mean squared difference divided by
+  /// 255^2) of the locations verified by FindPatterns()
+  double max_score{0.25};
+  /// Maximum number of locations taken from each score map by FindPatterns()
+  int max_locations{16};
+  /// Matches overlapping a better one by more than this fraction of the
+  /// smaller area are suppressed by SuppressOverlaps()
+  double max_overlap{0.5};
+};
+
+/// Best match of a single (mask, image polarity, template polarity) job
+struct MatchCandidate {
+  double mssim{0.};
+  cv::Rect roi;
+};
+
+/// Result of a pattern search on a single image
+struct MatchResult {
+  double mssim{0.};
+  /// Threshold used to find the match
+  double threshold{0.};
+  /// Matching region including the blur margins
+  cv::Rect roi;
+  /// Index of the matching mask or -1
+  int mask{-1};
+  /// Size of the matching mask on the image relative to its own size
+  double scale{1.};
+};
+
+/// Grayscale image and masks prepared for matching the masks at a different
+/// scale. Scales above 1 shrink the image, scales below 1 shrink the masks, so
+/// no level is larger than the original image.
+struct ScaleLevel {
+  /// Size of the masks on the original image relative to their own size
+  double scale{1.};
+  /// Factor mapping the level coordinates to the original image
+  double image_scale{1.};
+  /// The original image, or the image resized by `1 / scale` for scales
+  /// above 1
+  cv::Mat gray;
+  /// The masks resized by `scale` for scales below 1 (in the original order).
+  /// Empty if the original masks are used.
+  std::vector<Mask> masks;
+
+  /// Returns the masks to match on `gray`
+  const std::vector<Mask>& Masks(const std::vector<Mask>& original) const
+  {
+    return masks.empty() ? original : masks;
+  }
+};
+
+/// Calculates MSSIM similarity coefficients for each channel
+cv::Scalar GetMSSIM(const cv::Mat& i1, const cv::Mat& i2);
+
+/// Calculates average channel similarity coefficient
+double GetAvgMSSIM(const cv::Mat& i1, const cv::Mat& i2);
+
+/// Searches for matching pattern over the whole image
+/// \param match_loc Match location
+/// \param img Input image
+/// \param tpl The pattern to search for
+void MatchTemplateExhaustive(cv::Point& match_loc, const cv::Mat& img, const cv::Mat& tpl);
+
+/// Searches for matching pattern exhaustively or using the image pyramid
+/// depending on `opts`
+void MatchTemplate(cv::Point& match_loc, const cv::Mat& img, const cv::Mat& tpl,
+    const MatchOptions& opts);
+
+/// Searches for the masks on thresholded versions of grayscale image
+/// \param gray Grayscale region of interest
+/// \param threshold Noise suppression threshold
+/// \param masks Masks to search for
+/// \param pool Pool running the matching jobs
+/// \param best_mssim MSSIM of the best match found so far (e.g. with other
+/// thresholds). Candidates that can't exceed it are skipped, so the result is
+/// only meaningful if its MSSIM is greater.
+/// \param stats Statistics to update (optional)
+/// \returns Best match with `roi` relative to `gray`, or the first one
+/// reaching `opts.accept_mssim`
+MatchResult FindPattern(const cv::Mat& gray, double threshold,
+    const std::vector<Mask>& masks, ThreadPool& pool, const MatchOptions& opts,
+    double best_mssim, RunStats* stats);
+
+/// Searches for all occurrences of the masks on thresholded versions of
+/// grayscale image.
+///
+/// Local minima of the exhaustive score maps below `opts.max_score` are
+/// verified with MSSIM, and the overlapping matches are suppressed. Pyramid
+/// search and early termination options are ignored.
+/// \param min_mssim Matches with MSSIM not exceeding this value are dropped
+/// \returns Matches with `roi` relative to `gray` sorted by MSSIM (descending)
+std::vector<MatchResult> FindPatterns(const cv::Mat& gray, double threshold,
+    const std::vector<Mask>& masks, ThreadPool& pool, const MatchOptions& opts,
+    double min_mssim, RunStats* stats);
+
+/// Builds levels of `gray` and `masks` for each of `scales`. The levels are
+/// ordered by the distance of the scale from 1 (in log scale), so the search
+/// starts with the most probable sizes. Levels smaller than a pixel are
+/// skipped.
+/// \param stats Statistics to update (optional). The resizing is accounted as
+/// the threshold stage.
+std::vector<ScaleLevel> BuildScaleLevels(const cv::Mat& gray,
+    const std::vector<Mask>& masks, const std::vector<double>& scales,
+    RunStats* stats);
+
+/// Maps `rect` found on a level to the original image coordinates
+/// \param scale `ScaleLevel::image_scale` of the level
+cv::Rect ScaleRect(const cv::Rect& rect, double scale);
+
+/// Sorts `matches` by MSSIM (descending) and removes the ones overlapping a
+/// better match by more than `max_overlap` of the smaller area (non-maximum
+/// suppression)
+void SuppressOverlaps(std::vector<MatchResult>& matches, double max_overlap);
+
+#endif // MATCHER_HXX
+// vim: et ts=2 sts=2 sw=2
@@ -0,0 +1,303 @@
+/* \file
+ *
+ * \copyright Copyright © 2015  Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "redact.hxx"
+
+/////////////////////////////////////////////////////////////////////
+
+namespace {
+
+/// Maximum number of box blur passes
+const int kMaxBoxPasses{3};
+
+
+/// Returns widths of `n` box filters whose successive application
+/// approximates Gaussian blur with deviation `sigma`.
+///
+/// The widths are odd numbers `wl` and `wl + 2` mixed so that the variance of
+/// the sum `sum (w^2 - 1) / 12` is as close to `sigma^2` as possible.
+std::vector<int>
+GetBoxWidths(double sigma, int n)
+{
+  const double ideal = std::sqrt(12. * sigma * sigma / n + 1.);
+  int wl = static_cast<int>(std::floor(ideal));
+  if (wl % 2 == 0) --wl;
+  wl = std::max(wl, 1);
+  const int wu = wl + 2;
+
+  const double m_ideal = (12. * sigma * sigma - n * wl * wl - 4. * n * wl - 3. * n) / (-4. * wl - 4.);
+  const int m = std::min(n, std::max(0, static_cast<int>(std::round(m_ideal))));
+
+  std::vector<int> widths;
+  for (int i = 0; i < n; ++i) {
+    widths.push_back(i < m ? wl : wu);
+  }
+  return widths;
+}
+
+
+/// Returns box widths approximating the Gaussian blur of `opts` within the
+/// same radius
+std::vector<int>
+GetBoxWidths(const RedactOptions& opts)
+{
+  const int radius = GetBlurRadius(opts.kernel_size, opts.deviation);
+  if (radius < 1) {
+    return std::vector<int>();
+  }
+
+  // Deviation of the widest passes fitting into the radius. A truncated
+  // Gaussian kernel is closer to a box than the deviation suggests.
+  const int n = std::min(kMaxBoxPasses, radius);
+  const double max_width = 2. * radius / n + 1.;
+  const double max_sigma = std::sqrt(n * (max_width * max_width - 1.) / 12.);
+
+  auto widths = GetBoxWidths(std::min<double>(opts.deviation, max_sigma), n);
+
+  // Rounding may produce a wider pass; keep the total within the radius
+  int total = 0;
+  for (auto& width : widths) {
+    width = std::min(width, 2 * (radius - total) + 1);
+    total += width / 2;
+  }
+  return widths;
+}
+
+
+/// Running-sum box filter along the columns of `src` (CV_32F) with window
+/// of `2 * radius + 1` rows and replicated borders. The cost per pixel doesn't
+/// depend on `radius`; the inner loops run over contiguous rows, so they are
+/// vectorised by the compiler.
+void
+BoxFilterColumns(const cv::Mat& src, cv::Mat& dst, int radius)
+{
+  const int rows = src.rows;
+  const int width = src.cols * src.channels();
+  const float scale = 1.f / (2 * radius + 1);
+
+  dst.create(src.size(), src.type());
+  std::vector<float> acc(width, 0.f);
+  float* a = &acc[0];
+
+  for (int k = -radius; k <= radius; ++k) {
+    const float* row = src.ptr<float>(std::min(std::max(k, 0), rows - 1));
+    for (int x = 0; x < width; ++x) {
+      a[x] += row[x];
+    }
+  }
+
+  for (int y = 0; y < rows; ++y) {
+    float* out = dst.ptr<float>(y);
+    for (int x = 0; x < width; ++x) {
+      out[x] = a[x] * scale;
+    }
+
+    const float* add = src.ptr<float>(std::min(y + radius + 1, rows - 1));
+    const float* sub = src.ptr<float>(std::max(y - radius, 0));
+    for (int x = 0; x < width; ++x) {
+      a[x] += add[x] - sub[x];
+    }
+  }
+}
+
+
+/// Applies box filters of `widths` in both directions. Pixels around the
+/// region within the total radius are taken into account.
+void
+BoxBlur(cv::Mat& region, const std::vector<int>& widths)
+{
+  int radius = 0;
+  for (auto width : widths) {
+    radius += width / 2;
+  }
+  if (radius == 0 || region.empty()) {
+    return;
+  }
+
+  // Extend the region by the radius within the parent image
+  cv::Size whole_size;
+  cv::Point offset;
+  region.locateROI(whole_size, offset);
+  cv::Mat extended(region);
+  extended.adjustROI(radius, radius, radius, radius);
+  cv::Point extended_offset;
+  extended.locateROI(whole_size, extended_offset);
+  const cv::Rect inner(offset - extended_offset, region.size());
+
+  cv::Mat buf, tmp;
+  extended.convertTo(buf, CV_32F);
+
+  // Columns, then rows of the transposed buffer
+  for (int direction = 0; direction < 2; ++direction) {
+    for (auto width : widths) {
+      BoxFilterColumns(buf, tmp, width / 2);
+      std::swap(buf, tmp);
+    }
+    cv::transpose(buf, tmp);
+    std::swap(buf, tmp);
+  }
+
+  buf(inner).convertTo(region, region.type());
+}
+
+
+/// Replaces blocks of `block_size` pixels (aligned to the region origin) with
+/// their average color
+void
+Pixelate(cv::Mat& region, int block_size)
+{
+  CV_Assert(region.depth() == CV_8U);
+
+  const int cn = region.channels();
+  const int width = region.cols * cn;
+  std::vector<uint32_t> sums(width);
+
+  for (int by = 0; by < region.rows; by += block_size) {
+    const int bh = std::min(block_size, region.rows - by);
+
+    // Column sums of the band
+    std::fill(sums.begin(), sums.end(), 0);
+    for (int y = by; y < by + bh; ++y) {
+      const uchar* row = region.ptr<uchar>(y);
+      for (int x = 0; x < width; ++x) {
+        sums[x] += row[x];
+      }
+    }
+
+    uchar* first_row = region.ptr<uchar>(by);
+    for (int bx = 0; bx < region.cols; bx += block_size) {
+      const int bw = std::min(block_size, region.cols - bx);
+      const uint32_t count = bw * bh;
+
+      for (int c = 0; c < cn; ++c) {
+        uint32_t total = 0;
+        for (int x = bx; x < bx + bw; ++x) {
+          total += sums[x * cn + c];
+        }
+        const uchar mean = static_cast<uchar>((total + count / 2) / count);
+        for (int x = bx; x < bx + bw; ++x) {
+          first_row[x * cn + c] = mean;
+        }
+      }
+    }
+
+    for (int y = by + 1; y < by + bh; ++y) {
+      memcpy(region.ptr<uchar>(y), first_row, width);
+    }
+  }
+}
+
+} // namespace
+
+/////////////////////////////////////////////////////////////////////
+
+bool
+ParseRedactMode(const std::string& name, RedactMode& mode)
+{
+  if (name == "gaussian") {
+    mode = RedactMode::kGaussian;
+  } else if (name == "box") {
+    mode = RedactMode::kBox;
+  } else if (name == "pixelate") {
+    mode = RedactMode::kPixelate;
+  } else if (name == "fill") {
+    mode = RedactMode::kFill;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+
+void
+Redact(cv::Mat& region, const RedactOptions& opts)
+{
+  switch (opts.mode) {
+    case RedactMode::kGaussian:
+      Blur(region, opts.kernel_size, opts.deviation);
+      break;
+
+    case RedactMode::kBox:
+      BoxBlur(region, GetBoxWidths(opts));
+      break;
+
+    case RedactMode::kPixelate:
+      Pixelate(region, std::max(1, opts.block_size));
+      break;
+
+    case RedactMode::kFill:
+      region.setTo(cv::Scalar::all(0));
+      break;
+  }
+#if defined(DEBUG)
+  cv::rectangle(region, cv::Point(0,0),
+      cv::Point(region.cols, region.rows),
+      cv::Scalar(0,200,200), -1, 8);
+#endif
+}
+
+
+int
+GetRedactRadius(const RedactOptions& opts)
+{
+  switch (opts.mode) {
+    case RedactMode::kGaussian:
+      return GetBlurRadius(opts.kernel_size, opts.deviation);
+
+    case RedactMode::kBox:
+      {
+        int radius = 0;
+        for (auto width : GetBoxWidths(opts)) {
+          radius += width / 2;
+        }
+        return radius;
+      }
+
+    case RedactMode::kPixelate:
+    case RedactMode::kFill:
+      break;
+  }
+  return 0;
+}
+
+
+void
+Blur(cv::Mat& region, int kernel_size, int deviation)
+{
+  cv::GaussianBlur(region, region, cv::Size(kernel_size, kernel_size), deviation);
+}
+
+
+int
+GetBlurRadius(int kernel_size, int deviation)
+{
+  if (kernel_size > 0) {
+    return kernel_size / 2;
+  }
+  // cv::GaussianBlur() computes the kernel size from the deviation
+  return cvRound(deviation * 3) + 1;
+}
+
+// vim: et ts=2 sts=2 sw=2
@@ -0,0 +1,67 @@
+/* \file
+ *
+ * \copyright Copyright © 2015  Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#pragma once
+#ifndef REDACT_HXX
+#define REDACT_HXX
+
+#include <string>
+
+#include <opencv2/core/core.hpp>
+
+/// Ways to obscure the matched region
+enum class RedactMode {
+  /// cv::GaussianBlur()
+  kGaussian,
+  /// Running-sum box blur passes approximating the Gaussian blur
+  kBox,
+  /// Blocks filled with their average color
+  kPixelate,
+  /// Solid black fill
+  kFill
+};
+
+/// Parameters of Redact()
+struct RedactOptions {
+  RedactMode mode{RedactMode::kGaussian};
+  /// Gaussian kernel size. 0 means it is computed from `deviation`.
+  int kernel_size{3};
+  /// Gaussian deviation
+  int deviation{10};
+  /// Block size of the pixelation
+  int block_size{16};
+};
+
+/// Parses redaction mode name
+/// \returns `false` if the name is unknown
+bool ParseRedactMode(const std::string& name, RedactMode& mode);
+
+/// Obscures region of an image. Pixels around the region (within
+/// GetRedactRadius()) may be taken into account.
+void Redact(cv::Mat& region, const RedactOptions& opts);
+
+/// Returns number of pixels around a region affecting Redact() results
+int GetRedactRadius(const RedactOptions& opts);
+
+/// Blurs region of an image. Pixels around the region are taken into account.
+void Blur(cv::Mat& region, int kernel_size, int deviation);
+
+/// Returns number of pixels around a region affecting Blur() results
+int GetBlurRadius(int kernel_size, int deviation);
+
+#endif // REDACT_HXX
+// vim: et ts=2 sts=2 sw=2
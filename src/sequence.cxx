@@ -0,0 +1,149 @@
+/* \file
+ *
+ * \copyright Copyright © 2015  Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include "exceptions.hxx"
+#include "sequence.hxx"
+
+/////////////////////////////////////////////////////////////////////
+
+namespace {
+
+typedef std::unique_ptr<Frame> FramePtr;
+
+/// Blocking queue of frames with limited capacity
+class FrameQueue
+{
+  public:
+    explicit FrameQueue(size_t capacity) : mCapacity(capacity) {}
+
+    /// Waits for free space and pushes frame
+    void Push(FramePtr frame)
+    {
+      std::unique_lock<std::mutex> lock(mMutex);
+      mNotFull.wait(lock, [this] { return mQueue.size() < mCapacity; });
+      mQueue.push_back(std::move(frame));
+      mNotEmpty.notify_one();
+    }
+
+    /// Waits for a frame
+    /// \returns `false` if the queue is closed and empty
+    bool Pop(FramePtr& frame)
+    {
+      std::unique_lock<std::mutex> lock(mMutex);
+      mNotEmpty.wait(lock, [this] { return mClosed || !mQueue.empty(); });
+      if (mQueue.empty()) {
+        return false;
+      }
+      frame = std::move(mQueue.front());
+      mQueue.pop_front();
+      mNotFull.notify_one();
+      return true;
+    }
+
+    void Close()
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mClosed = true;
+      mNotEmpty.notify_all();
+    }
+
+  private:
+    size_t mCapacity;
+    std::deque<FramePtr> mQueue;
+    std::mutex mMutex;
+    std::condition_variable mNotEmpty;
+    std::condition_variable mNotFull;
+    bool mClosed{false};
+};
+
+
+/// Runs `stage` for `frame` unless a previous stage failed. Exceptions are
+/// stored in the frame.
+void
+RunStage(const FrameStage& stage, Frame& frame)
+{
+  if (!frame.error.empty()) {
+    return;
+  }
+
+  try {
+    stage(frame);
+  } catch (ErrorException& e) {
+    frame.error = e.what();
+  } catch (std::exception& e) {
+    frame.error = e.what();
+  }
+}
+
+} // namespace
+
+/////////////////////////////////////////////////////////////////////
+
+void
+RunSequence(const FrameReader& read, const FrameStage& process,
+    const FrameStage& write, const FrameStage& report, size_t depth)
+{
+  FrameQueue read_queue(depth);
+  FrameQueue write_queue(depth);
+
+  std::thread reader([&] {
+    for (;;) {
+      FramePtr frame(new Frame);
+      bool more{true};
+      try {
+        more = read(*frame);
+      } catch (ErrorException& e) {
+        frame->error = e.what();
+      } catch (std::exception& e) {
+        frame->error = e.what();
+      }
+      if (!more) {
+        break;
+      }
+      read_queue.Push(std::move(frame));
+    }
+    read_queue.Close();
+  });
+
+  std::thread writer([&] {
+    FramePtr frame;
+    while (write_queue.Pop(frame)) {
+      RunStage(write, *frame);
+      report(*frame);
+    }
+  });
+
+  // The frames are processed in order on the calling thread
+  FramePtr frame;
+  while (read_queue.Pop(frame)) {
+    RunStage(process, *frame);
+    write_queue.Push(std::move(frame));
+  }
+  write_queue.Close();
+
+  reader.join();
+  writer.join();
+}
+
+// vim: et ts=2 sts=2 sw=2
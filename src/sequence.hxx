@@ -0,0 +1,67 @@
+/* \file
+ *
+ * \copyright Copyright © 2015  Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#pragma once
+#ifndef SEQUENCE_HXX
+#define SEQUENCE_HXX
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+#include "matcher.hxx"
+#include "stats.hxx"
+
+/// Frame of an image sequence passed through RunSequence() stages
+struct Frame {
+  std::string input_file;
+  std::string output_file;
+  /// Decoded image
+  cv::Mat img;
+  /// Matches found on the image
+  std::vector<MatchResult> matches;
+  /// Statistics of the frame (optional)
+  std::unique_ptr<RunStats> stats;
+  /// Message of the exception thrown by a stage
+  std::string error;
+};
+
+/// Reads the next frame
+/// \returns `false` at the end of the sequence
+typedef std::function<bool(Frame& frame)> FrameReader;
+
+/// Processes a frame
+typedef std::function<void(Frame& frame)> FrameStage;
+
+/// Runs the stages for each frame of a sequence in the frame order.
+///
+/// `read`, `process` and `write` run on separate threads connected with
+/// bounded queues, so that reading (decoding) of the next frames and writing
+/// (encoding) of the previous ones overlap with processing of the current
+/// frame. An exception thrown by a stage is stored in `Frame::error`, and the
+/// following stages except `report` are skipped for the frame. `report` is
+/// called for every frame on the writing thread.
+/// \param depth Maximum number of frames waiting for each of the stages
+void RunSequence(const FrameReader& read, const FrameStage& process,
+    const FrameStage& write, const FrameStage& report, size_t depth);
+
+#endif // SEQUENCE_HXX
+// vim: et ts=2 sts=2 sw=2
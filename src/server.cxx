@@ -0,0 +1,397 @@
+/* \file
+ *
+ * \copyright Copyright © 2015  Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "exceptions.hxx"
+#include "server.hxx"
+
+/////////////////////////////////////////////////////////////////////
+
+namespace {
+
+/// Maximum length of a request header line
+const size_t kMaxLineLength = 64 * 1024;
+/// Maximum size of inline input image
+const size_t kMaxInputSize = 512 * 1024 * 1024;
+/// Interval of checking for the stop signal in milliseconds
+const int kPollInterval = 500;
+
+volatile sig_atomic_t g_stop = 0;
+
+
+void
+StopHandler(int)
+{
+  g_stop = 1;
+}
+
+
+/// Buffered reader of a socket
+class SocketReader
+{
+  public:
+    explicit SocketReader(int fd) : mFd(fd) {}
+
+    /// Reads line without the trailing newline.
+    /// \returns `false` on EOF before any data
+    bool ReadLine(std::string& line)
+    {
+      line.clear();
+      for (;;) {
+        if (mPos == mEnd && !Fill()) {
+          if (line.empty()) return false;
+          throw ErrorException("unexpected end of request");
+        }
+
+        const char* begin = mBuf + mPos;
+        const char* nl = static_cast<const char*>(memchr(begin, '\n', mEnd - mPos));
+        const size_t n = nl ? static_cast<size_t>(nl - begin) : mEnd - mPos;
+        line.append(begin, n);
+        mPos += n;
+
+        if (line.size() > kMaxLineLength) {
+          throw ErrorException("request line is too long");
+        }
+        if (nl) {
+          ++mPos;
+          if (!line.empty() && line.back() == '\r') line.pop_back();
+          return true;
+        }
+      }
+    }
+
+    void Read(unsigned char* data, size_t size)
+    {
+      while (size > 0) {
+        if (mPos == mEnd && !Fill()) {
+          throw ErrorException("unexpected end of request");
+        }
+        const size_t n = std::min(size, mEnd - mPos);
+        memcpy(data, mBuf + mPos, n);
+        mPos += n;
+        data += n;
+        size -= n;
+      }
+    }
+
+  private:
+    bool Fill()
+    {
+      // Wait for data checking for the stop signal, so that idle
+      // connections don't block the shutdown
+      struct pollfd pfd;
+      pfd.fd = mFd;
+      pfd.events = POLLIN;
+      while (poll(&pfd, 1, kPollInterval) <= 0) {
+        if (g_stop) return false;
+      }
+
+      ssize_t n;
+      do {
+        n = ::read(mFd, mBuf, sizeof(mBuf));
+      } while (n < 0 && errno == EINTR);
+      if (n <= 0) {
+        return false;
+      }
+      mPos = 0;
+      mEnd = n;
+      return true;
+    }
+
+    int mFd;
+    char mBuf[64 * 1024];
+    size_t mPos{0};
+    size_t mEnd{0};
+};
+
+
+void
+WriteAll(int fd, const void* data, size_t size)
+{
+  const char* p = static_cast<const char*>(data);
+  while (size > 0) {
+    ssize_t n = ::write(fd, p, size);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      throw ErrorException("failed to write response: %s", strerror(errno));
+    }
+    p += n;
+    size -= n;
+  }
+}
+
+
+/// Appends `value` to `header` replacing line breaks (which may come from
+/// exception messages, e.g. cv::Exception) with spaces, so that the value
+/// doesn't break the line protocol
+void
+AppendValue(std::string& header, const std::string& value)
+{
+  for (char c : value) {
+    header += (c == '\n' || c == '\r') ? ' ' : c;
+  }
+}
+
+
+void
+WriteResponse(int fd, const ServerResponse& response)
+{
+  std::string header;
+  for (auto& param : response.params) {
+    header += param.first + "=";
+    AppendValue(header, param.second);
+    header += "\n";
+  }
+  if (!response.output.empty()) {
+    header += "output-size=" + std::to_string(response.output.size()) + "\n";
+  }
+  header += "\n";
+
+  WriteAll(fd, header.data(), header.size());
+  if (!response.output.empty()) {
+    WriteAll(fd, &response.output[0], response.output.size());
+  }
+}
+
+
+/// Reads request from the client.
+/// \returns `false` if the client closed the connection
+bool
+ReadRequest(SocketReader& reader, ServerRequest& request)
+{
+  std::string line;
+
+  // Skip empty lines between requests
+  do {
+    if (!reader.ReadLine(line)) return false;
+  } while (line.empty());
+
+  do {
+    auto pos = line.find('=');
+    if (pos == std::string::npos) {
+      throw ErrorException("invalid request line: %s", line.c_str());
+    }
+    request.params[line.substr(0, pos)] = line.substr(pos + 1);
+
+    if (!reader.ReadLine(line)) {
+      throw ErrorException("unexpected end of request");
+    }
+  } while (!line.empty());
+
+  auto it = request.params.find("input-size");
+  if (it != request.params.end()) {
+    char* end;
+    errno = 0;
+    const unsigned long long size = strtoull(it->second.c_str(), &end, 10);
+    if (errno || *end || size > kMaxInputSize) {
+      throw ErrorException("invalid input size %s", it->second.c_str());
+    }
+    request.input.resize(size);
+    if (size) reader.Read(&request.input[0], size);
+  }
+
+  return true;
+}
+
+
+void
+HandleConnection(int fd, const ServerHandler& handler)
+{
+  SocketReader reader(fd);
+
+  for (;;) {
+    ServerRequest request;
+    ServerResponse response;
+
+    try {
+      if (!ReadRequest(reader, request)) {
+        break;
+      }
+    } catch (ErrorException& e) {
+      // The stream position is unknown, so the connection can't be reused
+      response.params.emplace_back("status", "error");
+      response.params.emplace_back("message", e.what());
+      WriteResponse(fd, response);
+      break;
+    } catch (std::exception& e) {
+      // Allocation of the input may throw bad_alloc
+      response.params.emplace_back("status", "error");
+      response.params.emplace_back("message", e.what());
+      WriteResponse(fd, response);
+      break;
+    }
+
+    try {
+      handler(request, response);
+    } catch (ErrorException& e) {
+      response = ServerResponse();
+      response.params.emplace_back("status", "error");
+      response.params.emplace_back("message", e.what());
+    } catch (std::exception& e) {
+      response = ServerResponse();
+      response.params.emplace_back("status", "error");
+      response.params.emplace_back("message", e.what());
+    }
+    WriteResponse(fd, response);
+  }
+}
+
+
+/// Bounded queue of accepted connections
+class ConnectionQueue
+{
+  public:
+    explicit ConnectionQueue(size_t capacity) : mCapacity(capacity) {}
+
+    /// Waits for free space and pushes connection
+    void Push(int fd)
+    {
+      std::unique_lock<std::mutex> lock(mMutex);
+      mNotFull.wait(lock, [this] { return mQueue.size() < mCapacity; });
+      mQueue.push_back(fd);
+      mNotEmpty.notify_one();
+    }
+
+    /// Waits for a connection
+    /// \returns `false` if the queue is closed
+    bool Pop(int& fd)
+    {
+      std::unique_lock<std::mutex> lock(mMutex);
+      mNotEmpty.wait(lock, [this] { return mClosed || !mQueue.empty(); });
+      if (mQueue.empty()) {
+        return false;
+      }
+      fd = mQueue.front();
+      mQueue.pop_front();
+      mNotFull.notify_one();
+      return true;
+    }
+
+    void Close()
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mClosed = true;
+      mNotEmpty.notify_all();
+    }
+
+  private:
+    size_t mCapacity;
+    std::deque<int> mQueue;
+    std::mutex mMutex;
+    std::condition_variable mNotEmpty;
+    std::condition_variable mNotFull;
+    bool mClosed{false};
+};
+
+} // namespace
+
+/////////////////////////////////////////////////////////////////////
+
+void
+Serve(const std::string& path, unsigned num_workers, size_t max_pending,
+    const ServerHandler& handler)
+{
+  struct sockaddr_un addr;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    throw ErrorException("socket path %s is too long", path.c_str());
+  }
+
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0) {
+    throw ErrorException("failed to create socket: %s", strerror(errno));
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+  // Remove stale socket left by a previous instance
+  struct stat st;
+  if (stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+    unlink(path.c_str());
+  }
+
+  if (bind(listen_fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0
+      || listen(listen_fd, SOMAXCONN) != 0) {
+    int err = errno;
+    close(listen_fd);
+    throw ErrorException("failed to listen on %s: %s", path.c_str(), strerror(err));
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, StopHandler);
+  signal(SIGTERM, StopHandler);
+
+  ConnectionQueue queue(max_pending);
+  std::vector<std::thread> workers;
+  for (unsigned i = 0; i < num_workers; ++i) {
+    workers.emplace_back([&queue, &handler] {
+      int fd;
+      while (queue.Pop(fd)) {
+        // An exception leaving the thread would terminate the server
+        try {
+          HandleConnection(fd, handler);
+        } catch (ErrorException& e) {
+          fprintf(stderr, "%s\n", e.what());
+        } catch (std::exception& e) {
+          fprintf(stderr, "%s\n", e.what());
+        }
+        close(fd);
+      }
+    });
+  }
+
+  while (!g_stop) {
+    struct pollfd pfd;
+    pfd.fd = listen_fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, kPollInterval) <= 0) {
+      continue;
+    }
+
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+      continue;
+    }
+    queue.Push(fd);
+  }
+
+  queue.Close();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  close(listen_fd);
+  unlink(path.c_str());
+}
+
+// vim: et ts=2 sts=2 sw=2
@@ -0,0 +1,64 @@
+/* \file
+ *
+ * \copyright Copyright © 2015  Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#pragma once
+#ifndef SERVER_HXX
+#define SERVER_HXX
+
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+/// Request received by Serve().
+///
+/// A request is a sequence of `key=value` header lines terminated with an
+/// empty line. If the `input-size` header is present, the header is followed
+/// by that number of bytes of the encoded input image.
+struct ServerRequest {
+  std::map<std::string, std::string> params;
+  /// Inline input image bytes
+  std::vector<unsigned char> input;
+};
+
+/// Response sent by Serve().
+///
+/// The response has the same format as the request. The `output-size`
+/// header is added automatically when `output` is not empty.
+struct ServerResponse {
+  std::vector<std::pair<std::string, std::string>> params;
+  /// Encoded output image bytes
+  std::vector<unsigned char> output;
+};
+
+/// Processes a request. ErrorException is reported to the client as
+/// `status=error` response with the exception message.
+typedef std::function<void(const ServerRequest&, ServerResponse&)> ServerHandler;
+
+/// Serves requests on Unix domain socket `path` until SIGINT or SIGTERM.
+///
+/// Connections are queued and handled by `num_workers` threads. Each
+/// connection may send several requests one after another. When
+/// `max_pending` connections are waiting in the queue, new connections are
+/// not accepted until a worker becomes free.
+void Serve(const std::string& path, unsigned num_workers, size_t max_pending,
+    const ServerHandler& handler);
+
+#endif // SERVER_HXX
+// vim: et ts=2 sts=2 sw=2
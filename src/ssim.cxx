@@ -0,0 +1,255 @@
+/* \file
+ *
+ * \copyright Copyright © 2015  Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "ssim.hxx"
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+# define SSIM_DISPATCH_AVX2 1
+# define SSIM_INLINE inline __attribute__((always_inline))
+#else
+# define SSIM_INLINE inline
+#endif
+
+/////////////////////////////////////////////////////////////////////
+
+namespace {
+
+const double kC1 = 6.5025, kC2 = 58.5225;
+
+/// Gaussian window size
+const int kWinSize = 11;
+const int kRadius = kWinSize / 2;
+const double kSigma = 1.5;
+
+/// Number of blurred quantities: I1, I2, I1^2, I2^2, I1*I2
+const int kNumPlanes = 5;
+
+/// Normalized Gaussian kernel equal to cv::getGaussianKernel(11, 1.5, CV_32F)
+struct Kernel {
+  float k[kWinSize];
+
+  Kernel()
+  {
+    double sum = 0.;
+    double tmp[kWinSize];
+    for (int i = 0; i < kWinSize; ++i) {
+      const double x = i - kRadius;
+      tmp[i] = std::exp(-x * x / (2 * kSigma * kSigma));
+      sum += tmp[i];
+    }
+    for (int i = 0; i < kWinSize; ++i) {
+      k[i] = static_cast<float>(tmp[i] / sum);
+    }
+  }
+};
+
+const Kernel g_kernel;
+
+
+/// Index of pixel `p` outside [0, len) as of cv::BORDER_REFLECT_101
+inline int
+Reflect101(int p, int len)
+{
+  if (len == 1) {
+    return 0;
+  }
+  while (p < 0 || p >= len) {
+    p = p < 0 ? -p : 2 * len - 2 - p;
+  }
+  return p;
+}
+
+
+/// Scratch memory reused by the calls made from the same thread
+struct Scratch {
+  /// Padded source rows of the kNumPlanes quantities
+  std::vector<float> padded;
+  /// Ring of horizontally blurred rows: kWinSize rows of kNumPlanes planes
+  std::vector<float> ring;
+  /// Vertically blurred planes of the current output row
+  std::vector<float> out;
+  std::vector<int> col_index;
+
+  void Reserve(int width)
+  {
+    const size_t padded_width = width + 2 * kRadius;
+    if (padded.size() < kNumPlanes * padded_width) {
+      padded.resize(kNumPlanes * padded_width);
+    }
+    if (ring.size() < static_cast<size_t>(kWinSize * kNumPlanes * width)) {
+      ring.resize(kWinSize * kNumPlanes * width);
+    }
+    if (out.size() < static_cast<size_t>(kNumPlanes * width)) {
+      out.resize(kNumPlanes * width);
+    }
+    col_index.resize(padded_width);
+  }
+};
+
+
+/// Blurs row `y` of both images horizontally into the ring slot
+SSIM_INLINE void
+BlurRowHorizontally(const cv::Mat& i1, const cv::Mat& i2, int y, Scratch& s)
+{
+  const int width = i1.cols;
+  const int padded_width = width + 2 * kRadius;
+  const uchar* a = i1.ptr<uchar>(y);
+  const uchar* b = i2.ptr<uchar>(y);
+
+  float* pa = &s.padded[0];
+  float* pb = pa + padded_width;
+  float* paa = pb + padded_width;
+  float* pbb = paa + padded_width;
+  float* pab = pbb + padded_width;
+  for (int x = 0; x < padded_width; ++x) {
+    const int sx = s.col_index[x];
+    const float va = a[sx], vb = b[sx];
+    pa[x] = va;
+    pb[x] = vb;
+    paa[x] = va * va;
+    pbb[x] = vb * vb;
+    pab[x] = va * vb;
+  }
+
+  float* dst = &s.ring[(y % kWinSize) * kNumPlanes * width];
+  for (int plane = 0; plane < kNumPlanes; ++plane) {
+    const float* src = &s.padded[plane * padded_width];
+    float* d = dst + plane * width;
+    for (int x = 0; x < width; ++x) {
+      d[x] = 0.f;
+    }
+    for (int j = 0; j < kWinSize; ++j) {
+      const float kj = g_kernel.k[j];
+      const float* sj = src + j;
+      for (int x = 0; x < width; ++x) {
+        d[x] += kj * sj[x];
+      }
+    }
+  }
+}
+
+
+SSIM_INLINE double
+MSSIMImpl(const cv::Mat& i1, const cv::Mat& i2, Scratch& s)
+{
+  const int width = i1.cols;
+  const int height = i1.rows;
+  const int plane_size = kNumPlanes * width;
+
+  s.Reserve(width);
+  for (int x = 0; x < width + 2 * kRadius; ++x) {
+    s.col_index[x] = Reflect101(x - kRadius, width);
+  }
+
+  // Rows [y - kRadius, y + kRadius] are kept in the ring. Reflected rows
+  // always fall into this range, see Reflect101().
+  int next_row = 0;
+  double total = 0.;
+
+  for (int y = 0; y < height; ++y) {
+    for (const int last = std::min(y + kRadius, height - 1); next_row <= last; ++next_row) {
+      BlurRowHorizontally(i1, i2, next_row, s);
+    }
+
+    float* out = &s.out[0];
+    for (int x = 0; x < plane_size; ++x) {
+      out[x] = 0.f;
+    }
+    for (int j = 0; j < kWinSize; ++j) {
+      const float kj = g_kernel.k[j];
+      const int sy = Reflect101(y + j - kRadius, height);
+      const float* src = &s.ring[(sy % kWinSize) * plane_size];
+      for (int x = 0; x < plane_size; ++x) {
+        out[x] += kj * src[x];
+      }
+    }
+
+    const float* mu1 = out;
+    const float* mu2 = mu1 + width;
+    const float* s11 = mu2 + width;
+    const float* s22 = s11 + width;
+    const float* s12 = s22 + width;
+    const float c1 = static_cast<float>(kC1), c2 = static_cast<float>(kC2);
+    float row_sum = 0.f;
+    for (int x = 0; x < width; ++x) {
+      const float mu1_2 = mu1[x] * mu1[x];
+      const float mu2_2 = mu2[x] * mu2[x];
+      const float mu1_mu2 = mu1[x] * mu2[x];
+      const float t3 = (2 * mu1_mu2 + c1) * (2 * (s12[x] - mu1_mu2) + c2);
+      const float t1 = (mu1_2 + mu2_2 + c1) * ((s11[x] - mu1_2) + (s22[x] - mu2_2) + c2);
+      row_sum += t3 / t1;
+    }
+    total += row_sum;
+  }
+
+  return total / (static_cast<double>(width) * height);
+}
+
+
+double
+MSSIMGeneric(const cv::Mat& i1, const cv::Mat& i2, Scratch& s)
+{
+  return MSSIMImpl(i1, i2, s);
+}
+
+
+#if defined(SSIM_DISPATCH_AVX2)
+__attribute__((target("avx2,fma"))) double
+MSSIMAvx2(const cv::Mat& i1, const cv::Mat& i2, Scratch& s)
+{
+  return MSSIMImpl(i1, i2, s);
+}
+
+
+bool
+HasAvx2()
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+#endif
+
+} // namespace
+
+/////////////////////////////////////////////////////////////////////
+
+double
+GetGrayMSSIM(const cv::Mat& i1, const cv::Mat& i2)
+{
+  CV_Assert(i1.type() == CV_8UC1 && i2.type() == CV_8UC1
+      && i1.rows == i2.rows && i1.cols == i2.cols);
+
+  if (i1.rows == 0 || i1.cols == 0) {
+    return 0.;
+  }
+
+  static thread_local Scratch scratch;
+
+#if defined(SSIM_DISPATCH_AVX2)
+  static const bool has_avx2 = HasAvx2();
+  if (has_avx2) {
+    return MSSIMAvx2(i1, i2, scratch);
+  }
+#endif
+  return MSSIMGeneric(i1, i2, scratch);
+}
+
+// vim: et ts=2 sts=2 sw=2
@@ -0,0 +1,36 @@
+/* \file
+ *
+ * \copyright Copyright © 2015  Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#pragma once
+#ifndef SSIM_HXX
+#define SSIM_HXX
+
+#include <opencv2/core/core.hpp>
+
+/// Calculates MSSIM similarity coefficient of two 8-bit single-channel images
+/// of equal size.
+///
+/// Computes the same value as the generic GetMSSIM() (11x11 Gaussian window,
+/// sigma 1.5, reflected borders) in a single streaming pass over the rows
+/// without building full-size temporaries. The kernel is plain C++ compiled
+/// twice, for the baseline target and for AVX2/FMA, and the AVX2 build is
+/// selected at runtime if the CPU supports it; vectorization of the loops is
+/// left to the compiler. blurpat_bench checks it against GetMSSIM().
+double GetGrayMSSIM(const cv::Mat& i1, const cv::Mat& i2);
+
+#endif // SSIM_HXX
+// vim: et ts=2 sts=2 sw=2
@@ -0,0 +1,196 @@
+/* \file
+ *
+ * \copyright Copyright © 2015  Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include <mutex>
+#include <string>
+
+#include "stats.hxx"
+
+/////////////////////////////////////////////////////////////////////
+
+namespace {
+
+const char* const kStageNames[RunStats::kNumStages] = {
+  "decode", "threshold", "match", "ssim", "blur", "write"
+};
+
+/// Serializes WriteJson() calls
+std::mutex g_write_mutex;
+
+
+void
+AppendJsonString(std::string& out, const std::string& str)
+{
+  out += '"';
+  for (unsigned char c : str) {
+    switch (c) {
+      case '"':  out += "\\\""; break;
+      case '\\': out += "\\\\"; break;
+      case '\n': out += "\\n"; break;
+      case '\r': out += "\\r"; break;
+      case '\t': out += "\\t"; break;
+      default:
+        if (c < 0x20) {
+          char buf[8];
+          snprintf(buf, sizeof(buf), "\\u%04x", c);
+          out += buf;
+        } else {
+          out += c;
+        }
+    }
+  }
+  out += '"';
+}
+
+
+void
+AppendJsonRect(std::string& out, const cv::Rect& rect)
+{
+  char buf[64];
+  snprintf(buf, sizeof(buf), "[%d,%d,%d,%d]", rect.x, rect.y, rect.width, rect.height);
+  out += buf;
+}
+
+
+double
+ToMilliseconds(std::chrono::steady_clock::duration duration)
+{
+  return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+} // namespace
+
+/////////////////////////////////////////////////////////////////////
+
+RunStats::RunStats(const std::string& input_file, const std::string& output_file)
+  : mInputFile(input_file), mOutputFile(output_file),
+  mStart(std::chrono::steady_clock::now())
+{
+}
+
+
+void
+RunStats::AddStage(Stage stage, std::chrono::steady_clock::duration duration,
+    size_t bytes, size_t pixels)
+{
+  auto& counters = mStages[stage];
+  counters.ns += std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+  counters.bytes += bytes;
+  counters.pixels += pixels;
+  ++counters.calls;
+}
+
+
+void
+RunStats::MapCandidates(size_t first, const std::function<cv::Rect(const cv::Rect&)>& map)
+{
+  for (size_t i = first; i < mCandidates.size(); ++i) {
+    mCandidates[i].roi = map(mCandidates[i].roi);
+  }
+}
+
+
+void
+RunStats::SetResult(double mssim, double threshold, const cv::Rect& roi)
+{
+  mMssim = mssim;
+  mThreshold = threshold;
+  mRoi = roi;
+}
+
+
+void
+RunStats::AddMatch(double mssim, double threshold, const cv::Rect& roi)
+{
+  Candidate match;
+  match.image_polarity = 0;
+  match.template_polarity = 0;
+  match.threshold = threshold;
+  match.mssim = mssim;
+  match.roi = roi;
+  mMatches.push_back(match);
+}
+
+
+void
+RunStats::WriteJson(FILE* stream) const
+{
+  char buf[256];
+  std::string out;
+
+  out += "{\"input\":";
+  AppendJsonString(out, mInputFile);
+  out += ",\"output\":";
+  AppendJsonString(out, mOutputFile);
+
+  if (mError.empty()) {
+    snprintf(buf, sizeof(buf), ",\"status\":\"ok\",\"mssim\":%f,\"threshold\":%f,\"roi\":",
+        mMssim, mThreshold);
+    out += buf;
+    AppendJsonRect(out, mRoi);
+
+    if (!mMatches.empty()) {
+      out += ",\"matches\":[";
+      for (size_t i = 0; i < mMatches.size(); ++i) {
+        auto& match = mMatches[i];
+        snprintf(buf, sizeof(buf), "%s{\"mssim\":%f,\"threshold\":%f,\"roi\":",
+            i ? "," : "", match.mssim, match.threshold);
+        out += buf;
+        AppendJsonRect(out, match.roi);
+        out += '}';
+      }
+      out += ']';
+    }
+  } else {
+    out += ",\"status\":\"error\",\"message\":";
+    AppendJsonString(out, mError);
+  }
+
+  snprintf(buf, sizeof(buf), ",\"total_ms\":%.3f,\"stages\":{",
+      ToMilliseconds(std::chrono::steady_clock::now() - mStart));
+  out += buf;
+  for (int i = 0; i < kNumStages; ++i) {
+    auto& counters = mStages[i];
+    snprintf(buf, sizeof(buf),
+        "%s\"%s\":{\"ms\":%.3f,\"calls\":%u,\"bytes\":%llu,\"pixels\":%llu}",
+        i ? "," : "", kStageNames[i], counters.ns / 1e6, counters.calls.load(),
+        static_cast<unsigned long long>(counters.bytes),
+        static_cast<unsigned long long>(counters.pixels));
+    out += buf;
+  }
+
+  out += "},\"candidates\":[";
+  for (size_t i = 0; i < mCandidates.size(); ++i) {
+    auto& candidate = mCandidates[i];
+    out += i ? ",{\"mask\":" : "{\"mask\":";
+    AppendJsonString(out, candidate.mask);
+    snprintf(buf, sizeof(buf),
+        ",\"image_polarity\":%d,\"template_polarity\":%d,\"threshold\":%f,\"mssim\":%f,\"roi\":",
+        candidate.image_polarity, candidate.template_polarity,
+        candidate.threshold, candidate.mssim);
+    out += buf;
+    AppendJsonRect(out, candidate.roi);
+    out += '}';
+  }
+  out += "]}\n";
+
+  std::lock_guard<std::mutex> lock(g_write_mutex);
+  fwrite(out.data(), 1, out.size(), stream);
+  fflush(stream);
+}
+
+// vim: et ts=2 sts=2 sw=2
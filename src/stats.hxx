@@ -0,0 +1,151 @@
+/* \file
+ *
+ * \copyright Copyright © 2015  Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#pragma once
+#ifndef STATS_HXX
+#define STATS_HXX
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+/// Statistics of processing a single image.
+///
+/// Stage counters may be updated concurrently by the matching jobs. The
+/// durations of the stages running in parallel are summed over the threads.
+class RunStats
+{
+  public:
+    enum Stage {
+      kDecode,
+      kThreshold,
+      kMatch,
+      kSsim,
+      kBlur,
+      kWrite,
+      kNumStages
+    };
+
+    /// Score of a single (mask, image polarity, template polarity) candidate.
+    /// `roi` is in the image coordinates without the blur margins.
+    struct Candidate {
+      std::string mask;
+      int image_polarity;
+      int template_polarity;
+      double threshold;
+      double mssim;
+      cv::Rect roi;
+    };
+
+    RunStats(const std::string& input_file, const std::string& output_file);
+
+    /// Adds `duration` and the amount of data processed to `stage`. Thread-safe.
+    void AddStage(Stage stage, std::chrono::steady_clock::duration duration,
+        size_t bytes, size_t pixels);
+
+    /// Records candidate score. Not thread-safe.
+    void AddCandidate(const Candidate& candidate) { mCandidates.push_back(candidate); }
+    /// Replaces `roi` of the candidates recorded since the first `first` ones
+    /// with `map(roi)`. The search records the candidates in the coordinates
+    /// of the searched region, which its caller maps to the image. Not
+    /// thread-safe.
+    void MapCandidates(size_t first, const std::function<cv::Rect(const cv::Rect&)>& map);
+    size_t NumCandidates() const { return mCandidates.size(); }
+    const std::vector<Candidate>& Candidates() const { return mCandidates; }
+
+    void SetResult(double mssim, double threshold, const cv::Rect& roi);
+    /// Records one of several matches redacted on the image
+    void AddMatch(double mssim, double threshold, const cv::Rect& roi);
+    void SetError(const std::string& message) { mError = message; }
+
+    /// Writes the statistics as a single line JSON object. Lines written by
+    /// different threads are not interleaved.
+    void WriteJson(FILE* stream) const;
+
+  private:
+    struct StageCounters {
+      std::atomic<int64_t> ns{0};
+      std::atomic<uint64_t> bytes{0};
+      std::atomic<uint64_t> pixels{0};
+      std::atomic<unsigned> calls{0};
+    };
+
+    std::string mInputFile;
+    std::string mOutputFile;
+    std::chrono::steady_clock::time_point mStart;
+    StageCounters mStages[kNumStages];
+    std::vector<Candidate> mCandidates;
+    /// Matches of --multi mode
+    std::vector<Candidate> mMatches;
+    std::string mError;
+    double mMssim{0.};
+    double mThreshold{0.};
+    cv::Rect mRoi;
+};
+
+
+/// Measures wall time of a stage from construction to destruction.
+/// Does nothing if `stats` is `NULL`.
+class StageTimer
+{
+  public:
+    StageTimer(RunStats* stats, RunStats::Stage stage)
+      : mStats(stats), mStage(stage)
+    {
+      if (mStats) mStart = std::chrono::steady_clock::now();
+    }
+
+    ~StageTimer()
+    {
+      if (mStats) {
+        mStats->AddStage(mStage, std::chrono::steady_clock::now() - mStart, mBytes, mPixels);
+      }
+    }
+
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+
+    /// Adds amount of data processed by the stage
+    void Add(size_t bytes, size_t pixels)
+    {
+      mBytes += bytes;
+      mPixels += pixels;
+    }
+
+    /// Adds amount of data of image `img`
+    void Add(const cv::Mat& img)
+    {
+      Add(img.total() * img.elemSize(), img.total());
+    }
+
+  private:
+    RunStats* mStats;
+    RunStats::Stage mStage;
+    std::chrono::steady_clock::time_point mStart;
+    size_t mBytes{0};
+    size_t mPixels{0};
+};
+
+#endif // STATS_HXX
+// vim: et ts=2 sts=2 sw=2
@@ -0,0 +1,176 @@
+/* \file
+ *
+ * \copyright Copyright © 2015  Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include "thread_pool.hxx"
+
+
+ThreadPool::ThreadPool(unsigned num_threads)
+{
+  if (num_threads < 2) {
+    return;
+  }
+
+  for (unsigned i = 0; i < num_threads; ++i) {
+    mQueues.emplace_back(new Queue);
+  }
+  for (unsigned i = 0; i < num_threads; ++i) {
+    mWorkers.emplace_back(&ThreadPool::WorkerLoop, this, i);
+  }
+}
+
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mStop = true;
+  }
+  mWakeup.notify_all();
+
+  for (auto& worker : mWorkers) {
+    worker.join();
+  }
+}
+
+
+void
+ThreadPool::ParallelFor(size_t n, const std::function<void(size_t)>& fn)
+{
+  if (n == 0) {
+    return;
+  }
+
+  if (mWorkers.empty() || n == 1) {
+    for (size_t i = 0; i < n; ++i) {
+      fn(i);
+    }
+    return;
+  }
+
+  Batch batch;
+  batch.fn = &fn;
+  batch.remaining = n;
+
+  // Account for the jobs before queueing them, so that a concurrent Pop()
+  // never makes the counter negative
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mPending += n;
+  }
+
+  // Distribute the jobs round-robin starting from a rotating queue so that
+  // concurrent callers don't pile up on the first worker
+  const size_t num_queues = mQueues.size();
+  const size_t first = mNextQueue++ % num_queues;
+  for (size_t q = 0; q < num_queues; ++q) {
+    auto& queue = *mQueues[(first + q) % num_queues];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    for (size_t i = q; i < n; i += num_queues) {
+      queue.tasks.push_back(Task{&batch, i});
+    }
+  }
+  mWakeup.notify_all();
+
+  // Help the workers until all jobs of this batch are taken
+  Task task;
+  while (batch.remaining > 0 && Pop(first, task)) {
+    Execute(task);
+  }
+
+  std::unique_lock<std::mutex> lock(batch.mutex);
+  batch.done.wait(lock, [&batch] { return batch.remaining == 0; });
+
+  if (batch.error) {
+    std::rethrow_exception(batch.error);
+  }
+}
+
+
+bool
+ThreadPool::Pop(size_t self, Task& task)
+{
+  const size_t num_queues = mQueues.size();
+
+  for (size_t q = 0; q < num_queues; ++q) {
+    auto& queue = *mQueues[(self + q) % num_queues];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty()) {
+      continue;
+    }
+
+    // Own queue is processed LIFO, victims are robbed FIFO
+    if (q == 0) {
+      task = queue.tasks.back();
+      queue.tasks.pop_back();
+    } else {
+      task = queue.tasks.front();
+      queue.tasks.pop_front();
+    }
+
+    std::lock_guard<std::mutex> pending_lock(mMutex);
+    --mPending;
+    return true;
+  }
+
+  return false;
+}
+
+
+void
+ThreadPool::Execute(const Task& task)
+{
+  Batch& batch = *task.batch;
+
+  try {
+    (*batch.fn)(task.index);
+  } catch (...) {
+    std::lock_guard<std::mutex> lock(batch.mutex);
+    if (!batch.error) {
+      batch.error = std::current_exception();
+    }
+  }
+
+  // The caller may destroy the batch as soon as `remaining` drops to zero,
+  // so it is decremented under the batch mutex
+  std::lock_guard<std::mutex> lock(batch.mutex);
+  if (--batch.remaining == 0) {
+    batch.done.notify_all();
+  }
+}
+
+
+void
+ThreadPool::WorkerLoop(size_t self)
+{
+  Task task;
+
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mMutex);
+      mWakeup.wait(lock, [this] { return mStop || mPending > 0; });
+      if (mStop && mPending == 0) {
+        return;
+      }
+    }
+
+    while (Pop(self, task)) {
+      Execute(task);
+    }
+  }
+}
+
+// vim: et ts=2 sts=2 sw=2
@@ -0,0 +1,92 @@
+/* \file
+ *
+ * \copyright Copyright © 2015  Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#pragma once
+#ifndef THREAD_POOL_HXX
+#define THREAD_POOL_HXX
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// Work-stealing thread pool.
+///
+/// Each worker owns a task queue. A worker takes tasks from the back of its
+/// own queue and steals from the front of the others' queues when its own
+/// queue is empty. The pool may be shared by several threads.
+class ThreadPool
+{
+  public:
+    /// \param num_threads Number of worker threads. With less than 2 threads
+    /// the jobs run in the calling thread.
+    explicit ThreadPool(unsigned num_threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    /// Calls `fn(i)` for each `i` in [0, n) and waits for completion.
+    /// The calling thread takes part in the execution. The first exception
+    /// thrown by `fn` is rethrown after all jobs are done.
+    void ParallelFor(size_t n, const std::function<void(size_t)>& fn);
+
+    unsigned Size() const { return static_cast<unsigned>(mWorkers.size()); }
+
+  private:
+    /// Set of jobs submitted by a single ParallelFor() call
+    struct Batch {
+      const std::function<void(size_t)>* fn;
+      std::atomic<size_t> remaining;
+      std::mutex mutex;
+      std::condition_variable done;
+      std::exception_ptr error;
+    };
+
+    struct Task {
+      Batch* batch;
+      size_t index;
+    };
+
+    struct Queue {
+      std::mutex mutex;
+      std::deque<Task> tasks;
+    };
+
+    /// Takes a task from queue `self` or steals one from another queue
+    bool Pop(size_t self, Task& task);
+    void Execute(const Task& task);
+    void WorkerLoop(size_t self);
+
+    std::vector<std::unique_ptr<Queue>> mQueues;
+    std::vector<std::thread> mWorkers;
+    std::mutex mMutex;
+    std::condition_variable mWakeup;
+    /// Number of tasks queued but not taken yet
+    size_t mPending{0};
+    bool mStop{false};
+    std::atomic<size_t> mNextQueue{0};
+};
+
+#endif // THREAD_POOL_HXX
+// vim: et ts=2 sts=2 sw=2
@@ -25,7 +25,7 @@ fi
 : ${BLURPAT_MASKS_DIR:="$dir/tmp/m"}
 : ${masks_dir:="$BLURPAT_MASKS_DIR"}
 
-executable="$dir/bin/blurpat -s 0.2 -v -k 5 -d 100 -r 0,-400,10000,10000"
+executable="$dir/bin/blurpat -s 0.2 -k 5 -d 100 -r 0,-400,10000,10000"
 masks=`find $masks_dir/ -type f`
 
 #####################################################################
@@ -35,38 +35,9 @@ function print_header()
   echo -e "\033[1;32m>>\033[0m\033[1m $1\033[0m";
 }
 
-function get_best_threshold()
-{
-  local org_img="$1"
-  local out_img="$2"
-  local result=$3
-
-  local max_mssim=0
-  local best_threshold=35
-  for threshold in 35 45 60 80; do
-    mssim=$($executable -t${threshold} -i "${org_img}" -o "${out_img}" $masks \
-      | grep 'using MSSIM' | sed -r 's/.* ([0-9\.]+)$/\1/g')
-
-    [[ -z "$mssim" ]] && continue
-
-    echo Threshold: $threshold MSSIM: $mssim
-
-    if [[ $mssim > $max_mssim ]]; then
-      max_mssim=$mssim
-      best_threshold=$threshold
-    fi
-  done
-
-  print_header "org_img: $org_img out_img: $out_img max_mssim: $max_mssim best threshold: $best_threshold"
-
-  eval $result="'$best_threshold'"
-}
-
 #####################################################################
 
+print_header "Processing ${#img[@]} image(s)"
 for k in ${!img[@]}; do
-  print_header "Processing $k -> ${img[$k]}"
-  get_best_threshold "$k" "${img[$k]}" t
-  $executable -t ${t} -i ${k} -o ${img[$k]} $masks
-  sleep 1
-done
+  printf '%s\t%s\n' "$k" "${img[$k]}"
+done | $executable --threshold-sweep 35,45,60,80 -b - $masks